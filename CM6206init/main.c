@@ -56,10 +56,28 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <malloc/malloc.h>
 #include <mach/mach.h>
+#include <dispatch/dispatch.h>
 
 #include <CoreFoundation/CFNumber.h>
+#include <CoreAudio/CoreAudio.h>
+#include <AudioToolbox/AudioToolbox.h>
+#include <Accelerate/Accelerate.h>
 
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOMessage.h>
@@ -72,30 +90,250 @@
 // for debugging
 //#define VERBOSE
 
-#define kVendorID    0x0d8c
-#define kProductID    0x0102
+// Capture level monitor (-m). The levels of every monitored CM6206 input are published
+// in a POSIX shared memory object so they can be read without touching the audio stream,
+// e.g. with `cm6206init -L`.
+#define kStatsShmName           "/cm6206init.levels"
+#define kStatsMagic             0x43364C56    // 'C6LV'
+#define kStatsVersion           1
+#define kMaxMonitoredDevices    8
+#define kMonitorChannels        2             // the CM6206 mic input is stereo
+#define kMonitorSampleRate      48000.0
+#define kMonitorBufferFrames    4800          // 100 ms per block
+#define kMonitorNumBuffers      3
+#define kClipLevel              0.999f        // |x| above this counts as clipped
+#define kStatsReadTries         100           // 1 ms apart, for a consistent copy of an entry
+
+typedef struct CM6206ChannelLevels {
+    float                    peak;           // max |x| of the last block, 0..1
+    float                    rms;            // RMS of the last block
+    float                    dcOffset;       // mean of the last block
+    uint32_t                clipsLast;      // clipped samples in the last block
+    uint64_t                clipsTotal;     // clipped samples since monitoring started
+} CM6206ChannelLevels;
+
+typedef struct CM6206DeviceLevels {
+    _Atomic uint32_t        seq;            // odd while the writer is updating this entry
+    uint32_t                active;
+    char                    uid[128];       // Core Audio device UID
+    uint64_t                blocks;
+    int64_t                    lastUpdate;     // time() of the last block
+    CM6206ChannelLevels        ch[kMonitorChannels];
+} CM6206DeviceLevels;
+
+typedef struct CM6206StatsPage {
+    uint32_t                magic;
+    uint32_t                version;
+    uint32_t                nDevices;
+    uint32_t                nChannels;
+    uint32_t                sampleRate;
+    uint32_t                blockFrames;
+    CM6206DeviceLevels        dev[kMaxMonitoredDevices];
+} CM6206StatsPage;
+
+typedef struct MonitorSlot {
+    AudioQueueRef            queue;
+    CFStringRef                uid;
+    volatile int            running;
+    CM6206DeviceLevels        *levels;        // points into the shared stats page
+    float                    scratch[kMonitorBufferFrames];
+} MonitorSlot;
+
+// Write plans, compiled from the configuration (see "Configuration" below)
+#define kMaxPlans               16
+#define kMaxProfiles            16
+#define kMaxPlanWrites          16
+#define kMaxNameLen             32
+#define kMaxConfigSize          65536
+
+#define kQuirkNoSeize           0x0001        // don't fall back to USBInterfaceOpenSeize
+
+typedef struct CM6206Write {
+    UInt8                    byte1;
+    UInt8                    byte2;
+    UInt8                    regNo;
+} CM6206Write;
+
+typedef struct WritePlan {
+    UInt16                    idVendor;
+    UInt16                    idProduct;
+    char                    profile[kMaxNameLen];
+    int                        interfaceIndex;
+    int                        settleMs;
+    int                        openRetries;
+    int                        openIntervalMs;
+    int                        writeRetries;
+    UInt32                    quirks;
+    int                        nWrites;
+    CM6206Write                writes[kMaxPlanWrites];
+} WritePlan;
+
+// Always allocated zeroed, so two plans can be compared with memcmp.
+typedef struct PlanSet {
+    int                        nPlans;
+    WritePlan                plans[kMaxPlans];
+} PlanSet;
+
+// Register writes go through a port, so the same code drives real and simulated devices
+typedef struct CM6206Port {
+    int                        (*write)(void *ref, UInt8 byte1, UInt8 byte2, UInt8 regNo);
+    void                    *ref;
+    UInt32                    locationID;        // identifies the device in the shadow and journal
+} CM6206Port;
+
+// The I/O Kit calls of the daemon paths go through this, so the stress harness can run the real
+// DeviceAdded, DeviceNotification, ActivateDevices and dealWithDevice against simulated devices
+typedef struct CM6206Bus {
+    kern_return_t            (*getMatchingServices)(mach_port_t masterPort, CFDictionaryRef matching,
+                                                   io_iterator_t *iterator);
+    io_object_t                (*iteratorNext)(io_iterator_t iterator);
+    kern_return_t            (*objectRelease)(io_object_t object);
+    kern_return_t            (*getName)(io_registry_entry_t entry, char *name);
+    CFTypeRef                (*createProperty)(io_registry_entry_t entry, CFStringRef key,
+                                              CFAllocatorRef allocator, IOOptionBits options);
+    kern_return_t            (*addInterestNotification)(IONotificationPortRef notifyPort, io_service_t service,
+                                                       const char *interestType, IOServiceInterestCallback callback,
+                                                       void *refCon, io_object_t *notification);
+    IOReturn                (*createPlugInInterface)(io_service_t service, CFUUIDRef pluginType,
+                                                     CFUUIDRef interfaceType, IOCFPlugInInterface ***plugin,
+                                                     SInt32 *score);
+} CM6206Bus;
 
 typedef struct MyPrivateData {
+    struct MyPrivateData    *next;
     io_object_t                notification;
     IOUSBDeviceInterface    **deviceInterface;
     CFStringRef                deviceName;
+    UInt32                    locationID;
 } MyPrivateData;
 
+#define kOpenFailed                -2            // from dealWithDevice(): the device would not open
+
+// A device activation waiting on the main queue for its settle time or its next open attempt
+typedef struct PendingActivation {
+    io_service_t            service;        // our reference, released when done
+    UInt16                    idVendor;
+    UInt16                    idProduct;
+    UInt32                    locationID;
+    int                        attemptsLeft;    // to open the device
+} PendingActivation;
+
+#define kCM6206NumRegisters        256
+
+// Register journal (see "Register shadow and journal" below)
+#define kDefaultJournalPath        "/var/db/cm6206init.journal"
+#define kMaxJournalSize            65536        // compacted when it grows beyond this
+#define kMaxRecoveries            32
+
+// What we last wrote to the registers of one device
+typedef struct DeviceShadow {
+    struct DeviceShadow        *next;
+    UInt32                    locationID;
+    UInt16                    regs[kCM6206NumRegisters];
+    UInt8                    known[kCM6206NumRegisters];
+} DeviceShadow;
+
+// The registers a plan is about to touch, as they were before
+typedef struct RegisterSnapshot {
+    int                        nRegs;
+    UInt8                    regNo[kMaxPlanWrites];
+    UInt8                    known[kMaxPlanWrites];
+    UInt16                    value[kMaxPlanWrites];
+} RegisterSnapshot;
+
+// A transaction a previous run left unfinished
+typedef struct PendingRecovery {
+    UInt32                    txId;
+    UInt32                    locationID;
+    UInt16                    idVendor;
+    UInt16                    idProduct;
+    char                    profile[kMaxNameLen];
+    int                        nDone;            // writes known to have been acknowledged
+    int                        nPriors;
+    UInt8                    priorReg[kMaxPlanWrites];
+    UInt8                    priorKnown[kMaxPlanWrites];
+    UInt16                    priorValue[kMaxPlanWrites];
+} PendingRecovery;
+
+typedef struct SimDevice {
+    UInt32                    locationID;
+    UInt16                    idVendor;
+    UInt16                    idProduct;
+    double                    faultRate;        // chance that an open or write fails
+    int                        attached;
+    int                        openCount;
+    int                        interfaceOpenCount;
+    UInt32                    nWrites;
+    UInt32                    nFaults;
+    UInt16                    regs[kCM6206NumRegisters];
+    UInt8                    written[kCM6206NumRegisters];    // since the activation started
+    UInt16                    regsBefore[kCM6206NumRegisters];
+    UInt32                    nFaultsBefore;
+    io_object_t                notification;    // interest notification, 0 if none
+    IOServiceInterestCallback notifyCallback;
+    void                    *notifyRefCon;
+} SimDevice;
+
 
 static IONotificationPortRef    gNotifyPort;
-static io_iterator_t            gAddedIter;
+static io_iterator_t            gAddedIters[kMaxPlans];    // one per plan, same order as gPlans
+static PlanSet                    *gPlans;
+static const char                *gConfigPath;
+static dispatch_source_t        gConfigWatch;
+static int                        gReloadPending;
+static MyPrivateData            *gPrivateData;        // of the devices with a removal notification
+static int                        gLivePrivateData;    // for the leak check of the stress harness
+static int                        gTimeScale = 1;        // >1 compresses all delays (stress harness)
+static _Atomic UInt64            gWaitedMs;            // plan delays waited so far, uncompressed
+static int                        gDeferActivations;    // daemon: activatePlan() leaves the run loop free
+static int                        gPendingActivations;    // scheduled by scheduleActivation(), not yet done
+static double                    gActivationSeconds;    // spent in deferred activations (stress harness)
+static UInt64                    gDeadline;            // mach_absolute_time() at the end of a -t run, 0 if none
+static mach_timebase_info_data_t gTimebase;
 static CFRunLoopRef                gRunLoop;
 static int                        gVerbose;
+static CM6206StatsPage            *gStatsPage;
+static MonitorSlot                gMonitorSlots[kMaxMonitoredDevices];
+static DeviceShadow                *gShadows;
+static pthread_mutex_t            gShadowLock = PTHREAD_MUTEX_INITIALIZER;    // shadows, recoveries, journal
+static int                        gJournalFd = -1;
+static PendingRecovery            gRecoveries[kMaxRecoveries];
+static int                        gNumRecoveries;
+static const CM6206Bus            kIOKitBus = {
+    IOServiceGetMatchingServices, IOIteratorNext, IOObjectRelease, IORegistryEntryGetName,
+    IORegistryEntryCreateCFProperty, IOServiceAddInterestNotification, IOCreatePlugInInterfaceForService
+};
+static const CM6206Bus            *gBus = &kIOKitBus;        // the simulated bus during a stress test
 
 
 void printUsage( const char *progName )
 {
-    printf("Usage: %s [-s] [-d] [-v] [-V]\n", progName );
+    printf("Usage: %s [-s] [-d] [-t seconds] [-m] [-c file] [-j file] [-v] [-V] [-L] [-P] [-S options] [-r capture]\n", progName );
     printf("  Activates sound outputs on CM6206 USB devices.\n");
     printf("  -s: Silent mode (default in daemon mode)\n");
     printf("  -v: Verbose mode (default in non-daemon mode)\n");
     printf("  -d: Daemon mode: the program keeps running and automatically activates any\n");
     printf("      devices that are connected, or all devices upon wake-from-sleep.\n");
+    printf("  -t: One-shot mode with a deadline, for boot and login hooks: activate all devices\n");
+    printf("      in parallel and exit when they are done or the time is up. Devices that are\n");
+    printf("      not done are handed off to the daemon. Exit status: 0 if all devices are done,\n");
+    printf("      2 if some were handed off, 1 if that failed.\n");
+    printf("  -c: Read devices, profiles and retry policies from the given file. In daemon mode\n");
+    printf("      the file is reloaded when it changes or on SIGHUP, and only devices whose\n");
+    printf("      write plan changed are activated again.\n");
+    printf("  -j: Journal register writes to the given file (default with -d and -t: %s).\n", kDefaultJournalPath);
+    printf("      An apply that fails is rolled back; one interrupted by a crash or power loss\n");
+    printf("      is finished or undone the next time the device is activated.\n");
+    printf("  -m: Monitor capture levels (daemon mode only): publish per-channel peak, RMS,\n");
+    printf("      DC offset and clip counts of each CM6206 input in shared memory.\n");
+    printf("  -L: Print the levels published by a daemon running with -m and exit.\n");
+    printf("  -P: Print the compiled write plans and exit.\n");
+    printf("  -S: Stress test the device handling with simulated devices and exit. Options\n");
+    printf("      (comma-separated, all optional): devices=1000, seconds=10, faults=0.01,\n");
+    printf("      stuck=0.001, timescale=1000, seed=1, and the limits lag=250 (plan ms), memory=256 (KB),\n");
+    printf("      throughput=500 (activations/s), ports=2 (leaked mach ports).\n");
+    printf("  -r: Replay the CM6206 register writes found in a usbmon or pcap(ng) USB capture\n");
+    printf("      against a simulated device, compare the result with the profiles and exit.\n");
     printf("  -V: Print version number and exit.\n");
 }
 
@@ -211,473 +449,3783 @@ void CheckError(IOReturn err, char* where) {
 
 //================================================================================================
 //
-// "interface" handlers
+// Configuration
+//
+// The configuration lists profiles (sequences of register writes) and devices (which profile
+// to apply to a given vendor/product ID, plus quirks and retry policy). It is compiled once
+// into a WritePlan per device type, so activating a device never has to look at the text.
+//
+//    profile <name>
+//        write <byte1> <byte2> <register>
+//    device <vendor>:<product>       (hexadecimal, e.g. 0d8c:0102)
+//        use <profile>               (default: "default")
+//        interface <n>               interface that receives the writes (default: 1)
+//        settle <ms>                 pause before activating a new device (default: 1000)
+//        open-retries <n>            attempts to open the device (default: 20)
+//        open-interval <ms>          pause between those attempts (default: 1000)
+//        write-retries <n>           extra attempts per register write (default: 0)
+//        quirk noseize               don't seize the interface if it is in use
+//
+// Everything after a '#' is a comment.
 //
 //================================================================================================
 
-int writeCM6206Registers( IOUSBInterfaceInterface183 **intf, UInt8 byte1, UInt8 byte2, UInt8 regNo )
-{
-    UInt8 buf[8];
-    IOReturn err;
-    IOUSBDevRequest req;
-    UInt8 pipeNo = 0; // 0 is the default pipe (and the only one that works here)
-    
-    buf[0] = 0x20;
-    buf[1] = byte1;
-    buf[2] = byte2;
-    buf[3] = regNo;
-    
-    req.bmRequestType=USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface );
-    req.bRequest=0x09; // these values are taken from the SPDIF enable log
-    req.wValue=0x0200;
-    req.wIndex=0x03;
-    req.wLength=4;
-    req.pData=buf;
-    err=(*intf)->ControlRequest(intf,pipeNo,&req);
-    CheckError(err,"usbWriteCmdWithBRequest");
-    if (err==kIOUSBPipeStalled) (*intf)->ClearPipeStall(intf,pipeNo);
-    
-    return (err != 0);
-}
-
-//================================================================================================
-// This sends the actual activation commands
-void initCM6206(IOUSBInterfaceInterface183 **intf)
-{
-    int err = 0;
-    
+// Used when no configuration file is given; this is what version 2.1 had hard-coded.
+static const char kBuiltinConfig[] =
+    "profile default\n"
     // This should reset the registers
-    if( writeCM6206Registers(intf, 0x00,0x00,0x00) ) {
-        fprintf(stderr, "Error while resetting registers\n");
-        err = 1;
-    }
-    
+    "    write 0x00 0x00 0x00\n"
     // This enables SPDIF, values copied from SniffUSB log (this one was easy)
     // I'm not sure if the SPDIF outputs surround data, as I don't have the means to test it.
-    if( writeCM6206Registers(intf, 0x00,0x30,0x01) ) {
-        fprintf(stderr, "Error while attempting to enable SPDIF\n");
-        err = 1;
-    }
-    
+    "    write 0x00 0x30 0x01\n"
     // This enables sound output. Why on earth it's disabled upon power-on,
     // nobody knows (except maybe some Taiwanese engineer).
     // These values were taken from the ALSA USB driver: "Enable line-out driver mode,
     // set headphone source to front channels, enable stereo mic."
     // That's for the CM106, however. On the CM6206 they appear to enable everything.
-    if( writeCM6206Registers(intf, 0x04,0x80,0x02) ) {
-        fprintf(stderr, "Error while attempting to enable analog out\n");
-        err = 1;
-    }
-    
+    "    write 0x04 0x80 0x02\n"
     // Extra stuff, taken from the Alsa-user mailinglist.
     // The above works for me, so I didn't bother testing the following.
     // It may be completely redundant or make your Mac explode. Try at your own risk.
-    
     // "Enable DACx2, PLL binary, Soft Mute, and SPDIF-out"
-    //writeCM6206Registers(intf, 0x00,0xb0,0x01);
+    "    # write 0x00 0xb0 0x01\n"
     // "Enable all channels and select 48-pin chipset"
-    //writeCM6206Registers(intf, 0x7f,0x00,0x03);
+    "    # write 0x7f 0x00 0x03\n"
+    "device 0d8c:0102\n";
+
+typedef struct ConfigProfile {
+    char                    name[kMaxNameLen];
+    int                        nWrites;
+    CM6206Write                writes[kMaxPlanWrites];
+} ConfigProfile;
+
+
+const WritePlan *findPlan(const PlanSet *plans, UInt16 idVendor, UInt16 idProduct)
+{
+    for( int i=0; i<plans->nPlans; i++ ) {
+        if( plans->plans[i].idVendor == idVendor && plans->plans[i].idProduct == idProduct )
+            return &plans->plans[i];
+    }
+    return NULL;
+}
+
+// Would applying plan b to a device that has plan a applied change anything on the device?
+// Timing, retries and quirks only matter while a plan is being applied.
+int planWritesDiffer(const WritePlan *a, const WritePlan *b)
+{
+    return a->interfaceIndex != b->interfaceIndex || a->nWrites != b->nWrites ||
+           memcmp(a->writes, b->writes, a->nWrites * sizeof(CM6206Write)) != 0;
+}
+
+
+static void configError(const char *source, int lineNo, const char *fmt, ...)
+{
+    va_list args;
     
-    if(!err && gVerbose)
-        fprintf(stderr, "Successfully sent CM6206 activation commands!\n");
+    fprintf(stderr, "%s:%d: ", source, lineNo);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+static int parseNumber(const char *tok, int base, long min, long max, long *out)
+{
+    char *end;
+    long value;
+    
+    if( !tok || !*tok )
+        return -1;
+    value = strtol(tok, &end, base);
+    if( *end || value < min || value > max )
+        return -1;
+    *out = value;
+    return 0;
 }
 
 
-void dealWithInterface(io_service_t usbInterfaceRef)
+//================================================================================================
+// Compile configuration text into plans. Returns 0 on success; on failure the errors have been
+// printed and the contents of plans are undefined.
+//
+int parseConfig(const char *text, const char *source, PlanSet *plans)
 {
-    IOReturn                    err;
-    IOCFPlugInInterface         **iodev;    // requires <IOKit/IOCFPlugIn.h>
-    IOUSBInterfaceInterface183    **intf;
-    SInt32                        score;
+    ConfigProfile *profiles, *curProfile = NULL;
+    WritePlan *curDevice = NULL;
+    int nProfiles = 0, lineNo = 0, err = 0;
+    const char *p = text;
+    char line[256];
     
+    profiles = calloc(kMaxProfiles, sizeof(ConfigProfile));
+    bzero(plans, sizeof(PlanSet));
     
-    err = IOCreatePlugInInterfaceForService(usbInterfaceRef, kIOUSBInterfaceUserClientTypeID,
-                                            kIOCFPlugInInterfaceID, &iodev, &score);
-    if (err || !iodev) {
-        fprintf(stderr, "dealWithInterface: unable to create plugin. ret = %08x, iodev = %p\n", err, iodev);
-        return;
-    }
-    err = (*iodev)->QueryInterface(iodev, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID183), (LPVOID)&intf);
-    (*iodev)->Release(iodev);                // done with this
-    if (err || !intf) {
-        fprintf(stderr, "dealWithInterface: unable to create a device interface. ret = %08x, intf = %p\n", err, intf);
-        return;
-    }
-    err = (*intf)->USBInterfaceOpen(intf);
-    if (err) {
-        fprintf(stderr, "dealWithInterface: unable to open interface. ret = %08x\n", err);
+    while( *p && !err ) {
+        size_t len = strcspn(p, "\n");
+        char *tok[5], *s;
+        int nTok = 0;
+        long v[3];
         
-        // Alas, this doesn't solve the problem in OS X 10.4.*
-        err = (*intf)->USBInterfaceOpenSeize(intf);
-        if (err) {
-            fprintf(stderr, "dealWithInterface: unable to seize interface. ret = %08x\n", err);
-            return;
+        lineNo++;
+        if( len >= sizeof(line) ) {
+            configError(source, lineNo, "line too long");
+            err = 1;
+            break;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p += len;
+        if( *p )
+            p++;
+        if( (s = strchr(line, '#')) )
+            *s = '\0';
+        for( s = strtok(line, " \t\r"); s && nTok < 5; s = strtok(NULL, " \t\r") )
+            tok[nTok++] = s;
+        if( nTok == 0 )
+            continue;
+        if( nTok == 5 ) {
+            configError(source, lineNo, "too many arguments");
+            err = 1;
+        }
+        else if( strcmp(tok[0], "profile") == 0 ) {
+            if( nTok != 2 || strlen(tok[1]) >= kMaxNameLen ) {
+                configError(source, lineNo, "expected: profile <name>");
+                err = 1;
+                break;
+            }
+            for( int i=0; i<nProfiles; i++ ) {
+                if( strcmp(profiles[i].name, tok[1]) == 0 ) {
+                    configError(source, lineNo, "duplicate profile '%s'", tok[1]);
+                    err = 1;
+                }
+            }
+            if( nProfiles == kMaxProfiles ) {
+                configError(source, lineNo, "too many profiles (max. %d)", kMaxProfiles);
+                err = 1;
+            }
+            if( err )
+                break;
+            curProfile = &profiles[nProfiles++];
+            curDevice = NULL;
+            strcpy(curProfile->name, tok[1]);
+        }
+        else if( strcmp(tok[0], "device") == 0 ) {
+            char *colon = nTok == 2 ? strchr(tok[1], ':') : NULL;
+            long vid, pid;
+            
+            if( colon )
+                *colon = '\0';
+            if( !colon || parseNumber(tok[1], 16, 0, 0xffff, &vid) || parseNumber(colon + 1, 16, 0, 0xffff, &pid) ) {
+                configError(source, lineNo, "expected: device <vendor>:<product>");
+                err = 1;
+                break;
+            }
+            if( findPlan(plans, (UInt16)vid, (UInt16)pid) ) {
+                configError(source, lineNo, "duplicate device %04lx:%04lx", vid, pid);
+                err = 1;
+                break;
+            }
+            if( plans->nPlans == kMaxPlans ) {
+                configError(source, lineNo, "too many devices (max. %d)", kMaxPlans);
+                err = 1;
+                break;
+            }
+            curDevice = &plans->plans[plans->nPlans++];
+            curProfile = NULL;
+            curDevice->idVendor = (UInt16)vid;
+            curDevice->idProduct = (UInt16)pid;
+            strcpy(curDevice->profile, "default");
+            curDevice->interfaceIndex = 1;    // The second interface is the one we need
+            curDevice->settleMs = 1000;
+            curDevice->openRetries = 20;
+            curDevice->openIntervalMs = 1000;
+            curDevice->writeRetries = 0;
+        }
+        else if( curProfile && strcmp(tok[0], "write") == 0 ) {
+            if( nTok != 4 || parseNumber(tok[1], 0, 0, 0xff, &v[0]) || parseNumber(tok[2], 0, 0, 0xff, &v[1])
+               || parseNumber(tok[3], 0, 0, 0xff, &v[2]) ) {
+                configError(source, lineNo, "expected: write <byte1> <byte2> <register>");
+                err = 1;
+            }
+            else if( curProfile->nWrites == kMaxPlanWrites ) {
+                configError(source, lineNo, "too many writes in profile '%s' (max. %d)", curProfile->name, kMaxPlanWrites);
+                err = 1;
+            }
+            else {
+                CM6206Write *w = &curProfile->writes[curProfile->nWrites++];
+                w->byte1 = (UInt8)v[0];
+                w->byte2 = (UInt8)v[1];
+                w->regNo = (UInt8)v[2];
+            }
+        }
+        else if( curDevice && strcmp(tok[0], "use") == 0 ) {
+            if( nTok != 2 || strlen(tok[1]) >= kMaxNameLen ) {
+                configError(source, lineNo, "expected: use <profile>");
+                err = 1;
+            }
+            else
+                strcpy(curDevice->profile, tok[1]);
+        }
+        else if( curDevice && strcmp(tok[0], "quirk") == 0 ) {
+            if( nTok == 2 && strcmp(tok[1], "noseize") == 0 )
+                curDevice->quirks |= kQuirkNoSeize;
+            else {
+                configError(source, lineNo, "unknown quirk");
+                err = 1;
+            }
+        }
+        else if( curDevice && nTok == 2 && strcmp(tok[0], "interface") == 0 && !parseNumber(tok[1], 10, 0, 31, &v[0]) )
+            curDevice->interfaceIndex = (int)v[0];
+        else if( curDevice && nTok == 2 && strcmp(tok[0], "settle") == 0 && !parseNumber(tok[1], 10, 0, 60000, &v[0]) )
+            curDevice->settleMs = (int)v[0];
+        else if( curDevice && nTok == 2 && strcmp(tok[0], "open-retries") == 0 && !parseNumber(tok[1], 10, 1, 1000, &v[0]) )
+            curDevice->openRetries = (int)v[0];
+        else if( curDevice && nTok == 2 && strcmp(tok[0], "open-interval") == 0 && !parseNumber(tok[1], 10, 0, 60000, &v[0]) )
+            curDevice->openIntervalMs = (int)v[0];
+        else if( curDevice && nTok == 2 && strcmp(tok[0], "write-retries") == 0 && !parseNumber(tok[1], 10, 0, 100, &v[0]) )
+            curDevice->writeRetries = (int)v[0];
+        else {
+            configError(source, lineNo, "unexpected or invalid '%s'", tok[0]);
+            err = 1;
         }
     }
-#ifdef VERBOSE
-    {
-        UInt8 numPipes;
-        err = (*intf)->GetNumEndpoints(intf, &numPipes);
-        if (err) {
-            fprintf(stderr, "dealWithInterface: unable to get number of endpoints. ret = %08x\n", err);
-            (*intf)->USBInterfaceClose(intf);
-            (*intf)->Release(intf);
-            return;
+    
+    // Resolve the profile of each device into its plan
+    for( int d=0; d<plans->nPlans && !err; d++ ) {
+        WritePlan *plan = &plans->plans[d];
+        ConfigProfile *profile = NULL;
+        
+        for( int i=0; i<nProfiles && !profile; i++ ) {
+            if( strcmp(profiles[i].name, plan->profile) == 0 )
+                profile = &profiles[i];
         }
-        fprintf(stderr, "numPipes = %d\n", numPipes);
+        if( !profile ) {
+            fprintf(stderr, "%s: device %04x:%04x uses unknown profile '%s'\n", source,
+                    plan->idVendor, plan->idProduct, plan->profile);
+            err = 1;
+            break;
+        }
+        plan->nWrites = profile->nWrites;
+        memcpy(plan->writes, profile->writes, sizeof(plan->writes));
     }
-#endif
+    if( !err && plans->nPlans == 0 ) {
+        fprintf(stderr, "%s: no devices configured\n", source);
+        err = 1;
+    }
+    
+    free(profiles);
+    return err ? -1 : 0;
+}
+
 
-    initCM6206(intf);
+int loadConfigFile(const char *path, PlanSet *plans)
+{
+    FILE *f;
+    char *text;
+    size_t len;
+    int nRet;
     
-    err = (*intf)->USBInterfaceClose(intf);
-    if (err) {
-        fprintf(stderr, "dealWithInterface: unable to close interface. ret = %08x\n", err);
-        return;
+    f = fopen(path, "r");
+    if( !f ) {
+        perror(path);
+        return -1;
     }
-    err = (*intf)->Release(intf);
-    if (err) {
-        fprintf(stderr, "dealWithInterface: unable to release interface. ret = %08x\n", err);
-        return;
+    text = malloc(kMaxConfigSize + 1);
+    len = fread(text, 1, kMaxConfigSize + 1, f);
+    fclose(f);
+    if( len > kMaxConfigSize ) {
+        fprintf(stderr, "%s: file too large\n", path);
+        free(text);
+        return -1;
     }
+    text[len] = '\0';
+    nRet = parseConfig(text, path, plans);
+    free(text);
+    return nRet;
 }
 
 
-void dealWithDevice(io_service_t usbDeviceRef)
+void printPlans(const PlanSet *plans)
 {
-    IOReturn                    err;
-    IOCFPlugInInterface            **iodev;    // requires <IOKit/IOCFPlugIn.h>
-    IOUSBDeviceInterface        **dev;
-    SInt32                        score;
-    UInt8                        numConf;
-    IOUSBConfigurationDescriptorPtr    confDesc;
-    IOUSBFindInterfaceRequest        interfaceRequest;
-    io_iterator_t                iterator;
-    io_service_t                usbInterfaceRef;
-    int nCount;
-    int nAttempts = 20;
+    for( int i=0; i<plans->nPlans; i++ ) {
+        const WritePlan *plan = &plans->plans[i];
+        printf("device %04x:%04x profile '%s': interface %d, settle %d ms, %d x %d ms open, %d write retries%s\n",
+               plan->idVendor, plan->idProduct, plan->profile, plan->interfaceIndex, plan->settleMs,
+               plan->openRetries, plan->openIntervalMs, plan->writeRetries,
+               (plan->quirks & kQuirkNoSeize) ? ", noseize" : "");
+        for( int w=0; w<plan->nWrites; w++ )
+            printf("  write 0x%02x 0x%02x 0x%02x\n", plan->writes[w].byte1, plan->writes[w].byte2, plan->writes[w].regNo);
+    }
+}
+
+
+//================================================================================================
+//
+// Register shadow and journal
+//
+// The CM6206 registers cannot be read back through the interface we use, so the daemon keeps a
+// shadow of what it last wrote to each device (by location ID). Applying a plan is a transaction
+// that snapshots the shadow of the registers it touches, so a failed apply can be undone.
+// A register whose prior value is unknown (nothing written since the device appeared) cannot be
+// restored, so if a failed apply touched one, the remaining writes are retried instead.
+//
+// Every step is appended to the journal, one line each:
+//    B <tx> <pid> <location> <vendor> <product> <profile>   begin, by process <pid>
+//    P <tx> <register> <value>|-                       value before, '-' if unknown
+//    W <tx> <index> <byte1> <byte2> <register>         write acknowledged by the device
+//    R <tx> <register> <value>                         write done to roll back
+//    C <tx> or A <tx>                                  committed or aborted
+// B, P, C and A lines are synced to disk. A lost W line only means a few writes are repeated,
+// which is harmless. If the daemon dies in the middle of a transaction, the next run finishes it
+// when the device is activated again, or undoes it if the device now has a different profile.
+// Transaction IDs are random, as a one-shot run and the daemon may append to the same journal.
+// A transaction is only taken over once the process that began it is gone, and the journal is
+// not rewritten while another process that is still running has a transaction open.
+//
+// The one-shot workers (-t) activate devices in parallel. Each owns its device and with it the
+// shadow, so gShadowLock only guards the list, the pending recoveries and the journal file.
+//
+//================================================================================================
+
+static DeviceShadow *findShadow(UInt32 locationID, int create)
+{
+    DeviceShadow *shadow;
     
-    err = IOCreatePlugInInterfaceForService(usbDeviceRef, kIOUSBDeviceUserClientTypeID,
-                                            kIOCFPlugInInterfaceID, &iodev, &score);
-    if (err || !iodev) {
-        fprintf(stderr, "dealWithDevice: unable to create plugin. ret = %08x, iodev = %p\n", err, iodev);
-        return;
+    pthread_mutex_lock(&gShadowLock);
+    for( shadow = gShadows; shadow; shadow = shadow->next ) {
+        if( shadow->locationID == locationID )
+            break;
     }
-    err = (*iodev)->QueryInterface(iodev, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID197), (LPVOID)&dev);
-    (*iodev)->Release(iodev);    // done with this
-    if (err || !dev) {
-        fprintf(stderr, "dealWithDevice: unable to create a device interface. ret = %08x, dev = %p\n", err, dev);
-        return;
+    if( !shadow && create ) {
+        shadow = calloc(1, sizeof(DeviceShadow));
+        shadow->locationID = locationID;
+        shadow->next = gShadows;
+        gShadows = shadow;
     }
+    pthread_mutex_unlock(&gShadowLock);
+    return shadow;
+}
+
+// Called when a device goes away or may have lost power: its registers are unknown again
+void forgetShadow(UInt32 locationID)
+{
+    DeviceShadow **link;
     
-    // This is from another USB program I wrote where the device was sometimes slow.
-    // It doesn't hurt to leave it in.
-    do {
-        err = (*dev)->USBDeviceOpen(dev);
-        if(err) {
-            fprintf(stderr, "Trying to open device, %d seconds left...\n",nAttempts);
-            if( nAttempts > 1 )
-                sleep(1); // wait a second
+    pthread_mutex_lock(&gShadowLock);
+    for( link = &gShadows; *link; link = &(*link)->next ) {
+        if( (*link)->locationID == locationID ) {
+            DeviceShadow *shadow = *link;
+            *link = shadow->next;
+            free(shadow);
+            break;
         }
-        else
-            nAttempts = 1;
     }
-    while( --nAttempts > 0 );
-    if (err) {
-        fprintf(stderr, "dealWithDevice: unable to open device. ret = %08x\n", err);
-        return;
+    pthread_mutex_unlock(&gShadowLock);
+}
+
+void forgetShadows(void)
+{
+    pthread_mutex_lock(&gShadowLock);
+    while( gShadows ) {
+        DeviceShadow *shadow = gShadows;
+        gShadows = shadow->next;
+        free(shadow);
     }
+    pthread_mutex_unlock(&gShadowLock);
+}
+
+
+static void journalWrite(int sync, const char *fmt, ...)
+{
+    char line[256];
+    va_list args;
+    int len;
     
-    err = (*dev)->GetNumberOfConfigurations(dev, &numConf);
-    if (err || !numConf) {
-        fprintf(stderr, "dealWithDevice: unable to obtain the number of configurations. ret = %08x\n", err);
-        (*dev)->USBDeviceClose(dev);
-        (*dev)->Release(dev);
+    if( gJournalFd < 0 )
         return;
-    }
-#ifdef VERBOSE
-    fprintf(stderr, "found %d configurations\n", numConf);
-#endif
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if( len >= (int)sizeof(line) )
+        len = sizeof(line) - 1;
     
-    err = (*dev)->GetConfigurationDescriptorPtr(dev, 0, &confDesc);    // get the first config desc (index 0)
-    if (err) {
-        fprintf(stderr, "dealWithDevice:unable to get config descriptor for index 0\n");
-        (*dev)->USBDeviceClose(dev);
-        (*dev)->Release(dev);
-        return;
+    // Another instance (e.g. a one-shot run at login) may share the journal
+    pthread_mutex_lock(&gShadowLock);
+    flock(gJournalFd, LOCK_EX);
+    if( write(gJournalFd, line, len) != len )
+        perror("journal");
+    if( sync )
+        fsync(gJournalFd);
+    flock(gJournalFd, LOCK_UN);
+    pthread_mutex_unlock(&gShadowLock);
+}
+
+static UInt32 newTxId(void)
+{
+    UInt32 txId;
+    
+    do
+        txId = arc4random();
+    while( txId == 0 );
+    return txId;
+}
+
+static void formatValue(char *buf, size_t size, int known, UInt16 value)
+{
+    if( known )
+        snprintf(buf, size, "%04x", value);
+    else
+        snprintf(buf, size, "-");
+}
+
+
+//================================================================================================
+// Rewrite the journal with only the lines of transactions that never ended. With
+// loadRecoveries, those of them whose process is gone are also remembered so they can be dealt
+// with. If another running process has a transaction open, the journal is left as it is.
+//
+static int journalEnded(const UInt32 *ended, int nEnded, UInt32 txId)
+{
+    for( int i=0; i<nEnded; i++ ) {
+        if( ended[i] == txId )
+            return 1;
     }
-    err = (*dev)->SetConfiguration(dev, confDesc->bConfigurationValue);
-    if (err) {
-        fprintf(stderr, "dealWithDevice: unable to set the configuration\n");
-        (*dev)->USBDeviceClose(dev);
-        (*dev)->Release(dev);
-        return;
+    return 0;
+}
+
+// Is the process that began a transaction still around?
+static int ownerAlive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static PendingRecovery *findRecovery(UInt32 txId, UInt32 locationID)
+{
+    for( int i=0; i<gNumRecoveries; i++ ) {
+        if( (txId && gRecoveries[i].txId == txId) || (!txId && gRecoveries[i].locationID == locationID) )
+            return &gRecoveries[i];
     }
+    return NULL;
+}
+
+static void compactJournal(int loadRecoveries)
+{
+    struct stat st;
+    char *text, *out, *line, *save = NULL;
+    UInt32 *ended;
+    int nEnded = 0, nOut = 0, busy = 0, torn;
+    ssize_t len;
     
-    // It's probably possible to get the identifiers of the interface we want and
-    // directly query that interface, but this works too.
-    interfaceRequest.bInterfaceClass = kIOUSBFindInterfaceDontCare;    // requested class
-    interfaceRequest.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;    // requested subclass
-    interfaceRequest.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;    // requested protocol
-    interfaceRequest.bAlternateSetting = kIOUSBFindInterfaceDontCare;    // requested alt setting
-    
-    err = (*dev)->CreateInterfaceIterator(dev, &interfaceRequest, &iterator);
-    if (err) {
-        fprintf(stderr, "dealWithDevice: unable to create interface iterator\n");
-        (*dev)->USBDeviceClose(dev);
-        (*dev)->Release(dev);
+    pthread_mutex_lock(&gShadowLock);
+    flock(gJournalFd, LOCK_EX);
+    if( fstat(gJournalFd, &st) ) {
+        fprintf(stderr, "Journal unreadable\n");
+        flock(gJournalFd, LOCK_UN);
+        pthread_mutex_unlock(&gShadowLock);
         return;
     }
+    text = malloc(st.st_size + 1);
+    out = malloc(st.st_size + 1);
+    ended = malloc((st.st_size / 4 + 1) * sizeof(UInt32));
+    len = pread(gJournalFd, text, st.st_size, 0);
+    text[len > 0 ? len : 0] = '\0';
+    torn = len > 0 && text[len - 1] != '\n';
     
-    nCount = 0;
-    while( (usbInterfaceRef = IOIteratorNext(iterator)) ) {
+    // First find the transactions that are done with
+    for( char *p = text; *p; ) {
+        char kind;
+        unsigned tx;
+        if( sscanf(p, "%c %u", &kind, &tx) == 2 && (kind == 'C' || kind == 'A') )
+            ended[nEnded++] = tx;
+        p += strcspn(p, "\n");
+        if( *p )
+            p++;
+    }
+    
+    for( line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save) ) {
+        char kind, profile[kMaxNameLen], value[8];
+        unsigned tx, a, b, c, d;
+        int owner;
+        PendingRecovery *rec;
+        
+        if( sscanf(line, "%c %u", &kind, &tx) != 2 )
+            continue;    // a torn line from a crash
+        if( journalEnded(ended, nEnded, tx) )
+            continue;
+        nOut += sprintf(out + nOut, "%s\n", line);
+        if( kind != 'B' || sscanf(line, "B %u %d %x %x %x %31s", &tx, &owner, &a, &b, &c, profile) != 6 )
+            owner = 0;
+        else if( owner == getpid() )
+            continue;    // one of ours, still in progress
+        else if( ownerAlive(owner) ) {
+            busy = 1;
+            continue;
+        }
+        if( !loadRecoveries )
+            continue;
+        
+        rec = findRecovery(tx, 0);
+        if( kind == 'B' && owner && !rec && gNumRecoveries < kMaxRecoveries ) {
+            rec = &gRecoveries[gNumRecoveries++];
+            bzero(rec, sizeof(PendingRecovery));
+            rec->txId = tx;
+            rec->locationID = a;
+            rec->idVendor = (UInt16)b;
+            rec->idProduct = (UInt16)c;
+            strcpy(rec->profile, profile);
+        }
+        else if( kind == 'P' && rec && rec->nPriors < kMaxPlanWrites &&
+                 sscanf(line, "P %u %x %7s", &tx, &a, value) == 3 ) {
+            rec->priorReg[rec->nPriors] = (UInt8)a;
+            rec->priorKnown[rec->nPriors] = value[0] != '-';
+            rec->priorValue[rec->nPriors] = (UInt16)strtoul(value, NULL, 16);
+            rec->nPriors++;
+        }
+        else if( kind == 'W' && rec && sscanf(line, "W %u %u %x %x %x", &tx, &a, &b, &c, &d) == 5 ) {
+            if( (int)a + 1 > rec->nDone )
+                rec->nDone = a + 1;
+        }
+    }
+    
+    if( !busy ) {
+        ftruncate(gJournalFd, 0);
+        if( nOut && write(gJournalFd, out, nOut) != nOut )
+            perror("journal");
+        fsync(gJournalFd);
+    }
+    else if( torn && write(gJournalFd, "\n", 1) != 1 )    // so the next line is not glued to it
+        perror("journal");
+    flock(gJournalFd, LOCK_UN);
+    pthread_mutex_unlock(&gShadowLock);
+    
+    free(ended);
+    free(out);
+    free(text);
+}
+
+int OpenJournal(const char *path)
+{
+    gJournalFd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if( gJournalFd < 0 ) {
+        fprintf(stderr, "Unable to open journal %s, register writes are not journaled\n", path);
+        return -1;
+    }
+    compactJournal(1);
+    for( int i=0; i<gNumRecoveries && gVerbose; i++ )
+        fprintf(stderr, "Interrupted apply #%u of profile '%s' on device %08x (%d writes done)\n",
+                gRecoveries[i].txId, gRecoveries[i].profile, gRecoveries[i].locationID, gRecoveries[i].nDone);
+    return 0;
+}
+
+
+//================================================================================================
+// The transaction itself
+//
+
+// Do the writes of the plan from index first on. Returns the index of the write that failed, or -1.
+static int applyWrites(const CM6206Port *port, const WritePlan *plan, int first, DeviceShadow *shadow, UInt32 txId)
+{
+    for( int w=first; w<plan->nWrites; w++ ) {
+        const CM6206Write *write = &plan->writes[w];
+        int nAttempts = 0;
+        
+        while( port->write(port->ref, write->byte1, write->byte2, write->regNo) ) {
+            if( nAttempts++ >= plan->writeRetries ) {
+                fprintf(stderr, "Error while writing register %d (write %d of profile '%s')\n",
+                        write->regNo, w + 1, plan->profile);
+                return w;
+            }
+        }
+        shadow->regs[write->regNo] = write->byte1 | (write->byte2 << 8);
+        shadow->known[write->regNo] = 1;
+        journalWrite(0, "W %u %d %02x %02x %02x\n", txId, w, write->byte1, write->byte2, write->regNo);
+    }
+    return -1;
+}
+
+// Restore the snapshot, last touched register first. Returns non-zero if that failed too, or if
+// the snapshot has registers whose prior value is unknown; those are left as they are.
+static int rollback(const CM6206Port *port, DeviceShadow *shadow, const RegisterSnapshot *snap, UInt32 txId)
+{
+    int err = 0;
+    char value[8];
+    
+    for( int i=snap->nRegs-1; i>=0; i-- ) {
+        UInt8 regNo = snap->regNo[i];
+        if( !snap->known[i] ) {
+            err = 1;
+            continue;
+        }
+        if( port->write(port->ref, snap->value[i] & 0xff, snap->value[i] >> 8, regNo) ) {
+            err = 1;
+            shadow->known[regNo] = 0;
+            continue;
+        }
+        shadow->regs[regNo] = snap->value[i];
+        formatValue(value, sizeof(value), 1, snap->value[i]);
+        journalWrite(0, "R %u %02x %s\n", txId, regNo, value);
+    }
+    return err;
+}
+
+static int snapshotKnown(const RegisterSnapshot *snap)
+{
+    for( int i=0; i<snap->nRegs; i++ ) {
+        if( !snap->known[i] )
+            return 0;
+    }
+    return 1;
+}
+
+static void takeSnapshot(const WritePlan *plan, const DeviceShadow *shadow, RegisterSnapshot *snap)
+{
+    bzero(snap, sizeof(RegisterSnapshot));
+    for( int w=0; w<plan->nWrites; w++ ) {
+        UInt8 regNo = plan->writes[w].regNo;
+        int seen = 0;
+        for( int i=0; i<snap->nRegs && !seen; i++ )
+            seen = snap->regNo[i] == regNo;
+        if( seen )
+            continue;
+        snap->regNo[snap->nRegs] = regNo;
+        snap->known[snap->nRegs] = shadow->known[regNo];
+        snap->value[snap->nRegs] = shadow->regs[regNo];
+        snap->nRegs++;
+    }
+}
+
+// Drop the registers that none of the first nApplied writes touched, they need no rollback
+static void trimSnapshot(const WritePlan *plan, int nApplied, RegisterSnapshot *snap)
+{
+    int n = 0;
+    
+    for( int i=0; i<snap->nRegs; i++ ) {
+        int touched = 0;
+        for( int w=0; w<nApplied && !touched; w++ )
+            touched = plan->writes[w].regNo == snap->regNo[i];
+        if( !touched )
+            continue;
+        snap->regNo[n] = snap->regNo[i];
+        snap->known[n] = snap->known[i];
+        snap->value[n] = snap->value[i];
+        n++;
+    }
+    snap->nRegs = n;
+}
+
+// Deal with a transaction a previous run left unfinished on this device. Returns the id of
+// the transaction if it is to be finished by the one that follows, otherwise 0.
+static UInt32 resolveRecovery(const CM6206Port *port, const WritePlan *plan, DeviceShadow *shadow)
+{
+    PendingRecovery recovery, *rec;
+    UInt32 txId = 0;
+    
+    pthread_mutex_lock(&gShadowLock);
+    rec = findRecovery(0, port->locationID);
+    if( rec ) {
+        recovery = *rec;
+        *rec = gRecoveries[--gNumRecoveries];
+    }
+    pthread_mutex_unlock(&gShadowLock);
+    if( !rec )
+        return 0;
+    rec = &recovery;
+    
+    // The registers as they were before the interrupted apply
+    for( int i=0; i<rec->nPriors; i++ ) {
+        shadow->regs[rec->priorReg[i]] = rec->priorValue[i];
+        shadow->known[rec->priorReg[i]] = rec->priorKnown[i];
+    }
+    
+    if( rec->idVendor == plan->idVendor && rec->idProduct == plan->idProduct &&
+        strcmp(rec->profile, plan->profile) == 0 ) {
+        // Same plan: applying it again finishes the job, the writes are idempotent
+        fprintf(stderr, "Finishing interrupted apply #%u on device %08x\n", rec->txId, rec->locationID);
+        txId = rec->txId;
+    }
+    else {
+        RegisterSnapshot snap;
+        
+        fprintf(stderr, "Undoing interrupted apply #%u of profile '%s' on device %08x\n",
+                rec->txId, rec->profile, rec->locationID);
+        bzero(&snap, sizeof(snap));
+        snap.nRegs = rec->nPriors;
+        memcpy(snap.regNo, rec->priorReg, sizeof(snap.regNo));
+        memcpy(snap.known, rec->priorKnown, sizeof(snap.known));
+        memcpy(snap.value, rec->priorValue, sizeof(snap.value));
+        if( rollback(port, shadow, &snap, rec->txId) )
+            fprintf(stderr, "Undo incomplete, device %08x is in an unknown state\n", rec->locationID);
+        journalWrite(1, "A %u\n", rec->txId);
+    }
+    return txId;
+}
+
+static void journalEnd(UInt32 txId, int committed)
+{
+    struct stat st;
+    
+    journalWrite(1, "%c %u\n", committed ? 'C' : 'A', txId);
+    if( gJournalFd >= 0 && !fstat(gJournalFd, &st) && st.st_size > kMaxJournalSize )
+        compactJournal(0);
+}
+
+
+//================================================================================================
+//
+// "interface" handlers
+//
+//================================================================================================
+
+// All delays of a plan go through here
+void waitMs(int ms)
+{
+    if( ms > 0 ) {
+        gWaitedMs += ms;
+        usleep((useconds_t)ms * 1000 / gTimeScale);
+    }
+}
+
+// The deadline of a one-shot run (-t) is kept on the monotonic clock that dispatch_time() also
+// uses, as the wall clock is often stepped during boot
+void setDeadline(double seconds)
+{
+    mach_timebase_info(&gTimebase);
+    gDeadline = mach_absolute_time() + (UInt64)(seconds * NSEC_PER_SEC) * gTimebase.denom / gTimebase.numer;
+}
+
+// Time left before the deadline, in nanoseconds of real time
+UInt64 deadlineLeftNs(void)
+{
+    UInt64 now = mach_absolute_time();
+    
+    return now >= gDeadline ? 0 : (gDeadline - now) * gTimebase.numer / gTimebase.denom;
+}
+
+// Time left before the deadline, in plan milliseconds
+int deadlineLeftMs(void)
+{
+    double left;
+    
+    if( gDeadline == 0 )
+        return INT_MAX;
+    left = deadlineLeftNs() / 1e6 * gTimeScale;
+    return left >= INT_MAX ? INT_MAX : (int)left;
+}
+
+int writeCM6206Registers( IOUSBInterfaceInterface183 **intf, UInt8 byte1, UInt8 byte2, UInt8 regNo )
+{
+    UInt8 buf[8];
+    IOReturn err;
+    IOUSBDevRequest req;
+    UInt8 pipeNo = 0; // 0 is the default pipe (and the only one that works here)
+    
+    buf[0] = 0x20;
+    buf[1] = byte1;
+    buf[2] = byte2;
+    buf[3] = regNo;
+    
+    req.bmRequestType=USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface );
+    req.bRequest=0x09; // these values are taken from the SPDIF enable log
+    req.wValue=0x0200;
+    req.wIndex=0x03;
+    req.wLength=4;
+    req.pData=buf;
+    err=(*intf)->ControlRequest(intf,pipeNo,&req);
+    CheckError(err,"usbWriteCmdWithBRequest");
+    if (err==kIOUSBPipeStalled) (*intf)->ClearPipeStall(intf,pipeNo);
+    
+    return (err != 0);
+}
+
+static int writeInterfaceRegisters(void *ref, UInt8 byte1, UInt8 byte2, UInt8 regNo)
+{
+    return writeCM6206Registers((IOUSBInterfaceInterface183 **) ref, byte1, byte2, regNo);
+}
+
+//================================================================================================
+// This sends the actual activation commands, as listed in the plan for this device. It is all or
+// nothing: if a write still fails after the retries, the registers already written are restored,
+// or if that is not possible, the remaining writes get one more round of retries.
+// A write counts as done when the device acknowledges its ControlRequest. That is all the
+// verification there is, as the registers cannot be read back through this interface.
+//
+int initCM6206(const CM6206Port *port, const WritePlan *plan)
+{
+    DeviceShadow        *shadow = findShadow(port->locationID, 1);
+    RegisterSnapshot    snap;
+    UInt32                txId, resumedTxId;
+    char                value[8];
+    int                    failed, err = 0;
+    
+    resumedTxId = resolveRecovery(port, plan, shadow);
+    takeSnapshot(plan, shadow, &snap);
+    txId = newTxId();
+    journalWrite(snap.nRegs == 0, "B %u %d %08x %04x %04x %s\n", txId, (int)getpid(), port->locationID,
+                 plan->idVendor, plan->idProduct, plan->profile);
+    for( int i=0; i<snap.nRegs; i++ ) {
+        formatValue(value, sizeof(value), snap.known[i], snap.value[i]);
+        journalWrite(i == snap.nRegs - 1, "P %u %02x %s\n", txId, snap.regNo[i], value);
+    }
+    
+    failed = applyWrites(port, plan, 0, shadow, txId);
+    if( failed >= 0 ) {
+        trimSnapshot(plan, failed, &snap);
+        if( snapshotKnown(&snap) ) {
+            if( snap.nRegs )
+                fprintf(stderr, "Rolling back profile '%s' on device %08x\n", plan->profile, port->locationID);
+            if( rollback(port, shadow, &snap, txId) )
+                fprintf(stderr, "Rollback failed, the device is in an unknown state\n");
+            err = 1;
+        }
+        else {
+            fprintf(stderr, "Retrying the rest of profile '%s' on device %08x\n", plan->profile, port->locationID);
+            if( applyWrites(port, plan, failed, shadow, txId) >= 0 ) {
+                fprintf(stderr, "Profile '%s' is only partly applied to device %08x\n",
+                        plan->profile, port->locationID);
+                err = 1;
+            }
+        }
+    }
+    journalEnd(txId, !err);
+    if( resumedTxId )
+        journalEnd(resumedTxId, !err);
+    
+    if(!err && gVerbose)
+        fprintf(stderr, "Successfully sent CM6206 activation commands!\n");
+    return err;
+}
+
+
+// Returns 0 if the plan was applied
+int dealWithInterface(io_service_t usbInterfaceRef, const WritePlan *plan, UInt32 locationID)
+{
+    IOReturn                    err;
+    IOCFPlugInInterface         **iodev;    // requires <IOKit/IOCFPlugIn.h>
+    IOUSBInterfaceInterface183    **intf;
+    SInt32                        score;
+    int                            result;
+    
+    
+    err = gBus->createPlugInInterface(usbInterfaceRef, kIOUSBInterfaceUserClientTypeID,
+                                      kIOCFPlugInInterfaceID, &iodev, &score);
+    if (err || !iodev) {
+        fprintf(stderr, "dealWithInterface: unable to create plugin. ret = %08x, iodev = %p\n", err, iodev);
+        return -1;
+    }
+    err = (*iodev)->QueryInterface(iodev, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID183), (LPVOID)&intf);
+    (*iodev)->Release(iodev);                // done with this
+    if (err || !intf) {
+        fprintf(stderr, "dealWithInterface: unable to create a device interface. ret = %08x, intf = %p\n", err, intf);
+        return -1;
+    }
+    err = (*intf)->USBInterfaceOpen(intf);
+    if (err) {
+        fprintf(stderr, "dealWithInterface: unable to open interface. ret = %08x\n", err);
+        if( plan->quirks & kQuirkNoSeize ) {
+            (*intf)->Release(intf);
+            return -1;
+        }
+        
+        // Alas, this doesn't solve the problem in OS X 10.4.*
+        err = (*intf)->USBInterfaceOpenSeize(intf);
+        if (err) {
+            fprintf(stderr, "dealWithInterface: unable to seize interface. ret = %08x\n", err);
+            (*intf)->Release(intf);
+            return -1;
+        }
+    }
 #ifdef VERBOSE
-        fprintf(stderr, "found interface: %p\n", (void*)usbInterfaceRef);
+    {
+        UInt8 numPipes;
+        err = (*intf)->GetNumEndpoints(intf, &numPipes);
+        if (err) {
+            fprintf(stderr, "dealWithInterface: unable to get number of endpoints. ret = %08x\n", err);
+            (*intf)->USBInterfaceClose(intf);
+            (*intf)->Release(intf);
+            return -1;
+        }
+        fprintf(stderr, "numPipes = %d\n", numPipes);
+    }
 #endif
-        if( nCount == 1 ) // The second interface is the one we need
-            dealWithInterface(usbInterfaceRef); // Here the actual interesting stuff happens!!!
-        IOObjectRelease(usbInterfaceRef);
-        nCount++;
+
+    {
+        CM6206Port port = { writeInterfaceRegisters, intf, locationID };
+        result = initCM6206(&port, plan);
+    }
+    
+    err = (*intf)->USBInterfaceClose(intf);
+    if (err) {
+        fprintf(stderr, "dealWithInterface: unable to close interface. ret = %08x\n", err);
+        return result;
+    }
+    err = (*intf)->Release(intf);
+    if (err) {
+        fprintf(stderr, "dealWithInterface: unable to release interface. ret = %08x\n", err);
+        return result;
+    }
+    return result;
+}
+
+
+// Returns 0 if the device was activated, kOpenFailed if it could not be opened in nAttempts
+int dealWithDeviceAttempts(io_service_t usbDeviceRef, const WritePlan *plan, int nAttempts)
+{
+    IOReturn                    err;
+    IOCFPlugInInterface            **iodev;    // requires <IOKit/IOCFPlugIn.h>
+    IOUSBDeviceInterface        **dev;
+    SInt32                        score;
+    UInt8                        numConf;
+    IOUSBConfigurationDescriptorPtr    confDesc;
+    IOUSBFindInterfaceRequest        interfaceRequest;
+    io_iterator_t                iterator;
+    io_service_t                usbInterfaceRef;
+    UInt32                        locationID = 0;
+    int nCount;
+    int result = -1;
+    
+    err = gBus->createPlugInInterface(usbDeviceRef, kIOUSBDeviceUserClientTypeID,
+                                      kIOCFPlugInInterfaceID, &iodev, &score);
+    if (err || !iodev) {
+        fprintf(stderr, "dealWithDevice: unable to create plugin. ret = %08x, iodev = %p\n", err, iodev);
+        return -1;
+    }
+    err = (*iodev)->QueryInterface(iodev, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID197), (LPVOID)&dev);
+    (*iodev)->Release(iodev);    // done with this
+    if (err || !dev) {
+        fprintf(stderr, "dealWithDevice: unable to create a device interface. ret = %08x, dev = %p\n", err, dev);
+        return -1;
+    }
+    (*dev)->GetLocationID(dev, &locationID);
+    
+    // This is from another USB program I wrote where the device was sometimes slow.
+    // It doesn't hurt to leave it in.
+    do {
+        err = (*dev)->USBDeviceOpen(dev);
+        if(err) {
+            fprintf(stderr, "Trying to open device, %d attempts left...\n",nAttempts);
+            if( nAttempts > 1 && deadlineLeftMs() < plan->openIntervalMs ) {
+                fprintf(stderr, "dealWithDevice: deadline reached, giving up\n");
+                nAttempts = 1;
+            }
+            else if( nAttempts > 1 )
+                waitMs(plan->openIntervalMs);
+        }
+        else
+            nAttempts = 1;
+    }
+    while( --nAttempts > 0 );
+    if (err) {
+        fprintf(stderr, "dealWithDevice: unable to open device. ret = %08x\n", err);
+        (*dev)->Release(dev);
+        return kOpenFailed;
+    }
+    
+    err = (*dev)->GetNumberOfConfigurations(dev, &numConf);
+    if (err || !numConf) {
+        fprintf(stderr, "dealWithDevice: unable to obtain the number of configurations. ret = %08x\n", err);
+        (*dev)->USBDeviceClose(dev);
+        (*dev)->Release(dev);
+        return -1;
+    }
+#ifdef VERBOSE
+    fprintf(stderr, "found %d configurations\n", numConf);
+#endif
+    
+    err = (*dev)->GetConfigurationDescriptorPtr(dev, 0, &confDesc);    // get the first config desc (index 0)
+    if (err) {
+        fprintf(stderr, "dealWithDevice:unable to get config descriptor for index 0\n");
+        (*dev)->USBDeviceClose(dev);
+        (*dev)->Release(dev);
+        return -1;
+    }
+    err = (*dev)->SetConfiguration(dev, confDesc->bConfigurationValue);
+    if (err) {
+        fprintf(stderr, "dealWithDevice: unable to set the configuration\n");
+        (*dev)->USBDeviceClose(dev);
+        (*dev)->Release(dev);
+        return -1;
+    }
+    
+    // It's probably possible to get the identifiers of the interface we want and
+    // directly query that interface, but this works too.
+    interfaceRequest.bInterfaceClass = kIOUSBFindInterfaceDontCare;    // requested class
+    interfaceRequest.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;    // requested subclass
+    interfaceRequest.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;    // requested protocol
+    interfaceRequest.bAlternateSetting = kIOUSBFindInterfaceDontCare;    // requested alt setting
+    
+    err = (*dev)->CreateInterfaceIterator(dev, &interfaceRequest, &iterator);
+    if (err) {
+        fprintf(stderr, "dealWithDevice: unable to create interface iterator\n");
+        (*dev)->USBDeviceClose(dev);
+        (*dev)->Release(dev);
+        return -1;
+    }
+    
+    nCount = 0;
+    while( (usbInterfaceRef = gBus->iteratorNext(iterator)) ) {
+#ifdef VERBOSE
+        fprintf(stderr, "found interface: %p\n", (void*)usbInterfaceRef);
+#endif
+        if( nCount == plan->interfaceIndex )
+            result = dealWithInterface(usbInterfaceRef, plan, locationID); // Here the actual interesting stuff happens!!!
+        gBus->objectRelease(usbInterfaceRef);
+        nCount++;
+    }
+    
+    gBus->objectRelease(iterator);
+    iterator = 0;
+    
+    err = (*dev)->USBDeviceClose(dev);
+    if (err) {
+        fprintf(stderr, "dealWithDevice: error closing device - %08x\n", err);
+        (*dev)->Release(dev);
+        return result;
+    }
+    err = (*dev)->Release(dev);
+    if (err) {
+        fprintf(stderr, "dealWithDevice: error releasing device - %08x\n", err);
+        return result;
+    }
+    return result;
+}
+
+// Returns 0 if the device was activated
+int dealWithDevice(io_service_t usbDeviceRef, const WritePlan *plan)
+{
+    return dealWithDeviceAttempts(usbDeviceRef, plan, plan->openRetries);
+}
+
+
+//================================================================================================
+// Read the vendor and product ID of a device from the I/O Registry
+//
+int getDeviceIDs(io_service_t usbDevice, UInt16 *idVendor, UInt16 *idProduct)
+{
+    CFNumberRef        vendorRef, productRef;
+    SInt32            vendor = 0, product = 0;
+    int                ok;
+    
+    vendorRef = gBus->createProperty(usbDevice, CFSTR(kUSBVendorID), kCFAllocatorDefault, 0);
+    productRef = gBus->createProperty(usbDevice, CFSTR(kUSBProductID), kCFAllocatorDefault, 0);
+    ok = vendorRef && productRef &&
+         CFNumberGetValue(vendorRef, kCFNumberSInt32Type, &vendor) &&
+         CFNumberGetValue(productRef, kCFNumberSInt32Type, &product);
+    if (vendorRef)
+        CFRelease(vendorRef);
+    if (productRef)
+        CFRelease(productRef);
+    
+    *idVendor = (UInt16)vendor;
+    *idProduct = (UInt16)product;
+    return ok ? 0 : -1;
+}
+
+UInt32 getDeviceLocation(io_service_t usbDevice)
+{
+    CFNumberRef        locationRef;
+    SInt64            location = 0;
+    
+    locationRef = gBus->createProperty(usbDevice, CFSTR(kUSBDevicePropertyLocationID), kCFAllocatorDefault, 0);
+    if (locationRef) {
+        CFNumberGetValue(locationRef, kCFNumberSInt64Type, &location);
+        CFRelease(locationRef);
+    }
+    return (UInt32)location;
+}
+
+
+//================================================================================================
+// Private data for each device we know about. Real and simulated devices both use these,
+// so the stress harness can tell whether any are leaked.
+//
+MyPrivateData *newPrivateData(const char *deviceName)
+{
+    MyPrivateData    *privateDataRef;
+    
+    privateDataRef = malloc(sizeof(MyPrivateData));
+    bzero(privateDataRef, sizeof(MyPrivateData));
+    privateDataRef->deviceName = CFStringCreateWithCString(kCFAllocatorDefault, deviceName,
+                                                           kCFStringEncodingASCII);
+    privateDataRef->next = gPrivateData;
+    gPrivateData = privateDataRef;
+    gLivePrivateData++;
+    return privateDataRef;
+}
+
+void freePrivateData(MyPrivateData *privateDataRef)
+{
+    MyPrivateData **link = &gPrivateData;
+    
+    while( *link != privateDataRef )
+        link = &(*link)->next;
+    *link = privateDataRef->next;
+    if (privateDataRef->deviceName)
+        CFRelease(privateDataRef->deviceName);
+    if (privateDataRef->deviceInterface)
+        (*privateDataRef->deviceInterface)->Release(privateDataRef->deviceInterface);
+    if (privateDataRef->notification)
+        gBus->objectRelease(privateDataRef->notification);
+    free(privateDataRef);
+    gLivePrivateData--;
+}
+
+// Will we hear when the device at this location goes away?
+int hasPrivateData(UInt32 locationID)
+{
+    for( MyPrivateData *privateDataRef = gPrivateData; privateDataRef; privateDataRef = privateDataRef->next ) {
+        if( privateDataRef->locationID == locationID )
+            return 1;
+    }
+    return 0;
+}
+
+
+//================================================================================================
+//
+//    DeviceNotification
+//
+//    This routine will get called whenever any kIOGeneralInterest notification happens.  We are
+//    interested in the kIOMessageServiceIsTerminated message so that's what we look for.  Other
+//    messages are defined in IOMessage.h.
+//
+//================================================================================================
+void DeviceNotification(void *refCon, io_service_t service, natural_t messageType, void *messageArgument)
+{
+    MyPrivateData    *privateDataRef = (MyPrivateData *) refCon;
+    
+    if (messageType == kIOMessageServiceIsTerminated) {
+        if(gVerbose) {
+            fprintf(stderr, "CM6206 device removed.\n");
+            // Dump our private data just to see what it looks like.
+            fprintf(stderr, "privateDataRef->deviceName: ");
+            CFShow(privateDataRef->deviceName);
+        }
+        
+        // Whatever we wrote to it is gone with it
+        forgetShadow(privateDataRef->locationID);
+        
+        // Free the data we're no longer using now that the device is going away
+        freePrivateData(privateDataRef);
+    }
+}
+
+
+//================================================================================================
+//
+//    Deferred activation (daemon mode)
+//
+//    The daemon never sleeps on its run loop: the settle time of a new device, the interval
+//    between attempts to open it and the wait after a wake are spent on the main queue with
+//    dispatch_after, so that other devices, notifications and reloads are handled meanwhile.
+//
+//================================================================================================
+
+// Like waitMs(), but calls work(context) on the main queue after ms instead of blocking
+void afterMs(int ms, void *context, dispatch_function_t work)
+{
+    dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, (int64_t)ms * NSEC_PER_MSEC / gTimeScale),
+                     dispatch_get_main_queue(), context, work);
+}
+
+static void runActivation(void *context)
+{
+    PendingActivation    *act = context;
+    const WritePlan        *plan;
+    CFAbsoluteTime        start = CFAbsoluteTimeGetCurrent();
+    int                    err = 0;
+    
+    // The plan is looked up again as a reload may have replaced it in the meantime. A device
+    // that was unplugged is gone, and if it is back, it has an activation of its own.
+    plan = findPlan(gPlans, act->idVendor, act->idProduct);
+    if( plan && getDeviceLocation(act->service) == act->locationID )
+        err = dealWithDeviceAttempts(act->service, plan, 1);    // here the important stuff happens
+    gActivationSeconds += CFAbsoluteTimeGetCurrent() - start;
+    
+    if( err == kOpenFailed && --act->attemptsLeft > 0 ) {
+        afterMs(plan->openIntervalMs, act, runActivation);
+        return;
+    }
+    
+    // If we won't hear when it goes, its shadow would outlive it and a later device at
+    // this location would take its priors from it
+    if( !hasPrivateData(act->locationID) )
+        forgetShadow(act->locationID);
+    
+    gBus->objectRelease(act->service);
+    free(act);
+    gPendingActivations--;
+}
+
+// Activate a device after delayMs. Takes over the reference to service.
+void scheduleActivation(io_service_t service, const WritePlan *plan, int delayMs)
+{
+    PendingActivation *act = calloc(1, sizeof(PendingActivation));
+    
+    act->service = service;
+    act->idVendor = plan->idVendor;
+    act->idProduct = plan->idProduct;
+    act->locationID = getDeviceLocation(service);
+    act->attemptsLeft = plan->openRetries;
+    gPendingActivations++;
+    afterMs(delayMs, act, runActivation);
+}
+
+
+//================================================================================================
+//
+//    DeviceAdded
+//
+//    This routine is the callback for our IOServiceAddMatchingNotification.  When we get called
+//    we will look at all the devices that were added and we will:
+//
+//    1.  Create some private data to relate to each device
+//    2.  Submit an IOServiceAddInterestNotification of type kIOGeneralInterest for this device,
+//        using the refCon field to store a pointer to our private data.  When we get called with
+//        this interest notification, we can grab the refCon and access our private data.
+//  3.  Schedule the CM6206 activation routine for when the device has settled.
+//
+//================================================================================================
+void DeviceAdded(void *refCon, io_iterator_t iterator)
+{
+    kern_return_t        kr;
+    io_service_t        usbDevice;
+    
+    while ((usbDevice = gBus->iteratorNext(iterator))) {
+        io_name_t        deviceName;
+        MyPrivateData    *privateDataRef = NULL;
+        const WritePlan    *plan;
+        UInt16            idVendor, idProduct;
+        
+        fprintf(stderr, "CM6206 device added.\n");
+        
+        // The plan is looked up again for every device as a reload may have replaced it
+        if( getDeviceIDs(usbDevice, &idVendor, &idProduct) ||
+            !(plan = findPlan(gPlans, idVendor, idProduct)) ) {
+            fprintf(stderr, "No write plan for this device, ignoring it.\n");
+            gBus->objectRelease(usbDevice);
+            continue;
+        }
+        
+        // Get the USB device's name.
+        kr = gBus->getName(usbDevice, deviceName);
+        if (KERN_SUCCESS != kr) {
+            deviceName[0] = '\0';
+        }
+        
+        // Add some app-specific information about this device, including its name.
+        privateDataRef = newPrivateData(deviceName);
+        privateDataRef->locationID = getDeviceLocation(usbDevice);
+        
+        // Dump our data to stderr just to see what it looks like.
+        if(gVerbose) {
+            fprintf(stderr, "deviceName: ");
+            CFShow(privateDataRef->deviceName);
+        }
+        
+        // Register for an interest notification of this device being removed. Use a reference to our
+        // private data as the refCon which will be passed to the notification callback.
+        kr = gBus->addInterestNotification(gNotifyPort,                        // notifyPort
+                                              usbDevice,                        // service
+                                              kIOGeneralInterest,                // interestType
+                                              DeviceNotification,                // callback
+                                              privateDataRef,                    // refCon
+                                              &(privateDataRef->notification)    // notification
+                                              );
+        
+        if (KERN_SUCCESS != kr) {
+            // Without the notification nobody would ever free this
+            fprintf(stderr, "IOServiceAddInterestNotification returned 0x%08x.\n", kr);
+            privateDataRef->notification = 0;
+            freePrivateData(privateDataRef);
+        }
+        
+        // Waiting for the device to settle is not strictly necessary but it seems to avoid
+        // kernel panics when some third-party audio enhancers are active.
+        // The reference added by IOIteratorNext goes with the activation.
+        scheduleActivation(usbDevice, plan, plan->settleMs);
+    }
+}
+
+//================================================================================================
+//
+//    SignalHandler
+//
+//    This routine will get called when we interrupt the program (usually with a Ctrl-C from the
+//    command line).
+//
+//================================================================================================
+void SignalHandler( int sigraised )
+{
+    if(gVerbose)
+        fprintf(stderr, "CM6206Init caught signal %d, exiting\n", sigraised);
+    
+    exit(0);
+}
+
+
+//================================================================================================
+// Make a matching dictionary to find all devices with the given vendor & product ID
+//
+int makeDictionary( CFMutableDictionaryRef *matchingDictionary, SInt32 idVendor, SInt32 idProduct )
+{
+    CFNumberRef            numberRef = 0;
+    
+    *matchingDictionary = IOServiceMatching(kIOUSBDeviceClassName);    // requires <IOKit/usb/IOUSBLib.h>
+    if (!*matchingDictionary) {
+        fprintf(stderr, "Error: Could not create matching dictionary\n");
+        return -1;
+    }
+    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &idVendor);
+    if (!numberRef) {
+        fprintf(stderr, "Error: Could not create CFNumberRef for vendor\n");
+        return -1;
+    }
+    CFDictionaryAddValue(*matchingDictionary, CFSTR(kUSBVendorID), numberRef);
+    CFRelease(numberRef);
+    numberRef = 0;
+    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &idProduct);
+    if (!numberRef) {
+        fprintf(stderr, "Error: Could not create CFNumberRef for product\n");
+        return -1;
+    }
+    CFDictionaryAddValue(*matchingDictionary, CFSTR(kUSBProductID), numberRef);
+    CFRelease(numberRef);
+    numberRef = 0;
+    
+    return 0;
+}
+
+
+//================================================================================================
+// Look for all devices matching one plan and deal with them once. Returns the number found.
+//
+int activatePlan(mach_port_t masterPort, const WritePlan *plan)
+{
+    kern_return_t        kr;
+    CFMutableDictionaryRef     matchingDictionary = 0;    // requires <IOKit/IOKitLib.h>
+    io_iterator_t         iterator = 0;
+    io_service_t        usbDeviceRef;
+    int                    foundDevices = 0;
+    
+    if( makeDictionary( &matchingDictionary, plan->idVendor, plan->idProduct ) )
+        return 0;
+    
+    kr = gBus->getMatchingServices(masterPort, matchingDictionary, &iterator);
+    matchingDictionary = 0;        // this was consumed by the above call
+    if (kr) {
+        fprintf(stderr, "Error: Could not look up devices, err = %08x\n", kr);
+        return 0;
+    }
+    
+    while ( (usbDeviceRef = gBus->iteratorNext(iterator)) ) {
+        foundDevices++;
+        if(gVerbose)
+            fprintf(stderr, "CM6206 found (device %p)\n", (void*)usbDeviceRef);
+        if( gDeferActivations ) {
+            scheduleActivation(usbDeviceRef, plan, 0);
+            continue;
+        }
+        dealWithDevice(usbDeviceRef, plan);  // here the important stuff happens
+        gBus->objectRelease(usbDeviceRef);    // no longer need this reference
+    }
+    
+    gBus->objectRelease(iterator);
+    iterator = 0;
+    
+    return foundDevices;
+}
+
+
+//================================================================================================
+// Look for all configured devices and deal with them once.
+//
+int ActivateDevices()
+{
+    kern_return_t        kr;
+    mach_port_t            masterPort = 0;    // requires <mach/mach.h>
+    int                    foundDevice = 0;
+    
+    kr = IOMasterPort(MACH_PORT_NULL, &masterPort);
+    if (kr) {
+        fprintf(stderr, "Error: Could not create master port, err = %08x\n", kr);
+        return kr;
+    }
+    
+    for( int i=0; i<gPlans->nPlans; i++ )
+        foundDevice += activatePlan(masterPort, &gPlans->plans[i]);
+    if(! foundDevice && gVerbose)
+        fprintf(stderr, "No CM6206 device found on the USB bus.\n");
+    
+    mach_port_deallocate(mach_task_self(), masterPort);
+    
+    return 0;
+}
+
+
+static void wakeActivate(void *context)
+{
+    ActivateDevices();
+}
+
+//================================================================================================
+// Callback for power events (sleep, wake).
+//
+void powerCallback(void *rootPort, io_service_t y, natural_t msgType, void *msgArgument)
+{
+    if( msgType == kIOMessageSystemHasPoweredOn ) {
+        if(gVerbose)
+            fprintf(stderr, "Waking from sleep, re-activating any CM6206 devices...\n");
+        forgetShadows();    // the chips may have lost power
+        afterMs(1000, NULL, wakeActivate);
+    }
+    else if( msgType == kIOMessageCanSystemSleep ||
+             msgType == kIOMessageSystemWillSleep ) {
+        // This case must be treated, otherwise the system will wait in vain for the program
+        // to allow sleep, and only sleep after a timeout.
+        IOAllowPowerChange(* (io_connect_t *) rootPort, (long) msgArgument);
+    }
+}
+
+
+//================================================================================================
+//
+//    Configuration reload (daemon mode)
+//
+//    Each plan has its own matching notification. On reload the new configuration is compiled
+//    next to the old one and compared plan by plan: unchanged plans keep their notification and
+//    their devices are left alone, plans with other writes are re-applied to the devices that
+//    are present, and new or removed device types get their notification armed or released.
+//    A plan that only has new timing, retries or quirks replaces the old one without touching
+//    the devices.
+//
+//================================================================================================
+
+// Set up the matching notification for plan i and activate the devices already present.
+int armMatching(int i)
+{
+    kern_return_t            kr;
+    CFMutableDictionaryRef     matchingDictionary = 0;    // requires <IOKit/IOKitLib.h>
+    const WritePlan            *plan = &gPlans->plans[i];
+    
+    if( makeDictionary( &matchingDictionary, plan->idVendor, plan->idProduct ) )
+        return -1;
+    
+    kr = IOServiceAddMatchingNotification(gNotifyPort,                    // notifyPort
+                                          kIOFirstMatchNotification,    // notificationType
+                                          matchingDictionary,            // matching
+                                          DeviceAdded,                    // callback
+                                          NULL,                            // refCon
+                                          &gAddedIters[i]                // notification
+                                          );
+    if (kr) {
+        fprintf(stderr, "IOServiceAddMatchingNotification returned 0x%08x.\n", kr);
+        gAddedIters[i] = 0;
+        return -1;
+    }
+    
+    // Iterate once to get already-present devices and arm the notification
+    DeviceAdded(NULL, gAddedIters[i]);
+    return 0;
+}
+
+
+void ReloadConfig(void)
+{
+    PlanSet                *newPlans, *oldPlans = gPlans;
+    io_iterator_t        newIters[kMaxPlans];
+    int                    changed[kMaxPlans];
+    
+    newPlans = calloc(1, sizeof(PlanSet));
+    if( loadConfigFile(gConfigPath, newPlans) ) {
+        fprintf(stderr, "Keeping the previous configuration.\n");
+        free(newPlans);
+        return;
+    }
+    
+    bzero(newIters, sizeof(newIters));
+    for( int n=0; n<newPlans->nPlans; n++ ) {
+        const WritePlan *newPlan = &newPlans->plans[n];
+        const WritePlan *oldPlan = findPlan(oldPlans, newPlan->idVendor, newPlan->idProduct);
+        
+        // Devices are only touched again if their registers would change; a new retry policy
+        // just takes effect with the next activation
+        changed[n] = !oldPlan || planWritesDiffer(oldPlan, newPlan);
+        if( oldPlan && !changed[n] && memcmp(oldPlan, newPlan, sizeof(WritePlan)) != 0 && gVerbose )
+            fprintf(stderr, "Plan for %04x:%04x changed, but not its writes\n", newPlan->idVendor, newPlan->idProduct);
+        if( oldPlan ) {
+            int o = (int)(oldPlan - oldPlans->plans);
+            newIters[n] = gAddedIters[o];
+            gAddedIters[o] = 0;
+        }
+    }
+    // Device types that are no longer configured are not watched anymore
+    for( int o=0; o<oldPlans->nPlans; o++ ) {
+        if( gAddedIters[o] ) {
+            if(gVerbose)
+                fprintf(stderr, "Device %04x:%04x removed from configuration\n",
+                        oldPlans->plans[o].idVendor, oldPlans->plans[o].idProduct);
+            IOObjectRelease(gAddedIters[o]);
+        }
+    }
+    
+    gPlans = newPlans;
+    memcpy(gAddedIters, newIters, sizeof(gAddedIters));
+    free(oldPlans);
+    
+    for( int n=0; n<gPlans->nPlans; n++ ) {
+        const WritePlan *plan = &gPlans->plans[n];
+        
+        if( !changed[n] )
+            continue;
+        if(gVerbose)
+            fprintf(stderr, "Plan for %04x:%04x changed, applying it\n", plan->idVendor, plan->idProduct);
+        if( !gAddedIters[n] )
+            armMatching(n);        // also activates the devices that are already present
+        else
+            activatePlan(kIOMasterPortDefault, plan);
+    }
+    if(gVerbose)
+        fprintf(stderr, "Configuration reloaded from %s\n", gConfigPath);
+}
+
+
+int WatchConfigFile(void);
+
+static void delayedReload(void *context)
+{
+    gReloadPending = 0;
+    ReloadConfig();
+    if( !gConfigWatch )
+        WatchConfigFile();
+}
+
+static void configFileChanged(void *context)
+{
+    unsigned long flags = dispatch_source_get_data(gConfigWatch);
+    
+    // Editors that save by renaming a new file into place leave us watching the old one
+    if( flags & (DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME) ) {
+        dispatch_source_cancel(gConfigWatch);
+        dispatch_release(gConfigWatch);
+        gConfigWatch = NULL;
+    }
+    // Saving often takes several writes, so wait a moment and reload only once
+    if( !gReloadPending ) {
+        gReloadPending = 1;
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, 250 * NSEC_PER_MSEC), dispatch_get_main_queue(),
+                         NULL, delayedReload);
+    }
+}
+
+static void configWatchCancelled(void *context)
+{
+    close((int)(intptr_t)context);
+}
+
+// Watch the configuration file with kqueue (through a dispatch source) for changes
+int WatchConfigFile(void)
+{
+    int fd = open(gConfigPath, O_EVTONLY);
+    
+    if (fd < 0) {
+        fprintf(stderr, "Unable to watch %s, reload with SIGHUP\n", gConfigPath);
+        return -1;
+    }
+    gConfigWatch = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, fd,
+                                          DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND | DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME,
+                                          dispatch_get_main_queue());
+    if (!gConfigWatch) {
+        close(fd);
+        return -1;
+    }
+    dispatch_set_context(gConfigWatch, (void *)(intptr_t)fd);
+    dispatch_source_set_event_handler_f(gConfigWatch, configFileChanged);
+    dispatch_source_set_cancel_handler_f(gConfigWatch, configWatchCancelled);
+    dispatch_resume(gConfigWatch);
+    return 0;
+}
+
+
+// SIGHUP in daemon mode, delivered on the main queue rather than in signal context
+static void hangupReceived(void *context)
+{
+    if( gConfigPath )
+        ReloadConfig();
+    else
+        ActivateDevices();
+}
+
+
+//================================================================================================
+//
+//    One-shot activation with a deadline (-t)
+//
+//    Boot and login hooks run cm6206init once and wait for it, so with -t that run is bounded.
+//    Every configured device type is enumerated and every device found is activated on a worker
+//    of its own. The program exits as soon as all of them are done or the deadline has passed.
+//    Workers still busy by then (e.g. retrying a dongle that will not open) are left behind, and
+//    their devices are handed off to the daemon together with those that failed. So are the
+//    device types that could not be enumerated in time. An apply that is cut short this way is
+//    finished or undone through the journal.
+//
+//    A hand-off is a line "<location> <vendor>:<product> <pid>" appended to kHandoffPath, where
+//    location 0 stands for every device of that type. The daemon watches that file, empties it
+//    and activates those devices again in the background, once process <pid> has exited and it
+//    can take over the applies that process left open.
+//
+//================================================================================================
+
+#define kHandoffPath            "/var/run/cm6206init.handoff"
+#define kMaxOneShotDevices        64
+#define kMaxHandoffSize            65536
+#define kHandoffAttempts        3            // by the daemon, per handed-off device
+#define kHandoffRetryDelay        30            // s between those attempts
+#define kHandoffExitWait        30            // s to wait for the one-shot run to exit
+
+enum { kOneShotPending, kOneShotDone, kOneShotFailed };
+
+typedef struct OneShotDevice {
+    io_service_t            service;
+    const WritePlan            *plan;
+    UInt32                    locationID;
+    atomic_int                state;
+} OneShotDevice;
+
+struct OneShotRun;
+
+typedef struct OneShotJob {
+    struct OneShotRun        *run;
+    const WritePlan            *plan;
+    int                        enumerated;        // all devices of the type found and started
+} OneShotJob;
+
+typedef struct OneShotRun {
+    dispatch_group_t        group;
+    pthread_mutex_t            lock;            // guards nDevices and the enumerated flags
+    int                        nDevices;
+    OneShotJob                jobs[kMaxPlans];
+    OneShotDevice            devices[kMaxOneShotDevices];
+} OneShotRun;
+
+typedef struct HandoffRetry {
+    UInt32                    locationID;
+    UInt16                    idVendor;
+    UInt16                    idProduct;
+    pid_t                    pid;            // of the one-shot run, 0 if not known
+    int                        exitWait;        // seconds waited for it to exit
+    int                        attemptsLeft;
+} HandoffRetry;
+
+static dispatch_source_t        gHandoffWatch;
+
+
+static void oneShotActivate(void *context)
+{
+    OneShotDevice *dev = (OneShotDevice *) context;
+    
+    if( dealWithDevice(dev->service, dev->plan) )
+        atomic_store(&dev->state, kOneShotFailed);
+    else
+        atomic_store(&dev->state, kOneShotDone);
+    gBus->objectRelease(dev->service);
+}
+
+// Look up the devices of one plan and start a worker for each
+static void oneShotEnumerate(void *context)
+{
+    OneShotJob                *job = (OneShotJob *) context;
+    OneShotRun                *run = job->run;
+    CFMutableDictionaryRef     matchingDictionary = 0;
+    io_iterator_t            iterator = 0;
+    io_service_t            usbDeviceRef;
+    kern_return_t            kr;
+    int                        overflow = 0;
+    
+    if( makeDictionary( &matchingDictionary, job->plan->idVendor, job->plan->idProduct ) )
+        return;
+    kr = gBus->getMatchingServices(kIOMasterPortDefault, matchingDictionary, &iterator);
+    if (kr) {
+        fprintf(stderr, "Error: Could not look up devices, err = %08x\n", kr);
+        return;
+    }
+    
+    while ( (usbDeviceRef = gBus->iteratorNext(iterator)) ) {
+        OneShotDevice *dev = NULL;
+        
+        pthread_mutex_lock(&run->lock);
+        if( run->nDevices < kMaxOneShotDevices ) {
+            dev = &run->devices[run->nDevices];
+            dev->service = usbDeviceRef;
+            dev->plan = job->plan;
+            dev->locationID = getDeviceLocation(usbDeviceRef);
+            atomic_init(&dev->state, kOneShotPending);
+            run->nDevices++;
+        }
+        pthread_mutex_unlock(&run->lock);
+        
+        if( !dev ) {
+            fprintf(stderr, "Too many devices, leaving the rest to the daemon\n");
+            gBus->objectRelease(usbDeviceRef);
+            overflow = 1;
+            continue;
+        }
+        if(gVerbose)
+            fprintf(stderr, "CM6206 found at %08x\n", (unsigned)dev->locationID);
+        dispatch_group_async_f(run->group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                               dev, oneShotActivate);
+    }
+    gBus->objectRelease(iterator);
+    
+    // With devices left out, the whole type is handed off for a rescan
+    pthread_mutex_lock(&run->lock);
+    job->enumerated = !overflow;
+    pthread_mutex_unlock(&run->lock);
+}
+
+// Returns 0 if all devices not done, and all device types not enumerated, could be handed off
+static int handOff(const OneShotRun *run, const int *states, int nDevices, const int *enumerated)
+{
+    const OneShotDevice    *devices = run->devices;
+    char                line[64];
+    int                    fd, err = 0;
+    
+    fd = open(kHandoffPath, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(kHandoffPath);
+        return -1;
+    }
+    flock(fd, LOCK_EX);
+    for( int i=0; i<nDevices; i++ ) {
+        int len;
+        
+        if( states[i] == kOneShotDone )
+            continue;
+        len = snprintf(line, sizeof(line), "%08x %04x:%04x %d\n", (unsigned)devices[i].locationID,
+                       devices[i].plan->idVendor, devices[i].plan->idProduct, (int)getpid());
+        if( write(fd, line, len) != len )
+            err = -1;
+    }
+    for( int i=0; i<gPlans->nPlans; i++ ) {
+        int len;
+        
+        if( enumerated[i] )
+            continue;
+        len = snprintf(line, sizeof(line), "%08x %04x:%04x %d\n", 0, run->jobs[i].plan->idVendor,
+                       run->jobs[i].plan->idProduct, (int)getpid());
+        if( write(fd, line, len) != len )
+            err = -1;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return err;
+}
+
+// Exits with 0 if every device was activated, 2 if some were handed off to the daemon and 1 if
+// that was not possible either.
+int RunOneShot(double seconds)
+{
+    static OneShotRun        run;            // the workers left behind still use it
+    int                        states[kMaxOneShotDevices], enumerated[kMaxPlans];
+    int                        nDevices, nEnumerated = 0, nDone = 0, allFinished;
+    
+    setDeadline(seconds);
+    run.group = dispatch_group_create();
+    pthread_mutex_init(&run.lock, NULL);
+    for( int i=0; i<gPlans->nPlans; i++ ) {
+        run.jobs[i].run = &run;
+        run.jobs[i].plan = &gPlans->plans[i];
+        dispatch_group_async_f(run.group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                               &run.jobs[i], oneShotEnumerate);
+    }
+    
+    allFinished = dispatch_group_wait(run.group, dispatch_time(DISPATCH_TIME_NOW, deadlineLeftNs())) == 0;
+    
+    // Workers left behind may still finish, but what is reported is what gets handed off
+    pthread_mutex_lock(&run.lock);
+    nDevices = run.nDevices;
+    for( int i=0; i<gPlans->nPlans; i++ ) {
+        enumerated[i] = run.jobs[i].enumerated;
+        nEnumerated += enumerated[i];
+    }
+    pthread_mutex_unlock(&run.lock);
+    for( int i=0; i<nDevices; i++ )
+        states[i] = atomic_load(&run.devices[i].state);
+    
+    printf("%d CM6206 device%s found in %.1f s%s\n", nDevices, nDevices == 1 ? "" : "s",
+           seconds - deadlineLeftNs() / 1e9, allFinished ? "" : ", deadline reached");
+    for( int i=0; i<nDevices; i++ ) {
+        const OneShotDevice *dev = &run.devices[i];
+        int state = states[i];
+        
+        printf("  %08x  %04x:%04x  %-16s %s\n", (unsigned)dev->locationID, dev->plan->idVendor,
+               dev->plan->idProduct, dev->plan->profile,
+               state == kOneShotDone ? "done" :
+               state == kOneShotFailed ? "failed, handed off to the daemon" :
+               "still busy, handed off to the daemon");
+        if( state == kOneShotDone )
+            nDone++;
+    }
+    for( int i=0; i<gPlans->nPlans; i++ ) {
+        if( !enumerated[i] )
+            printf("  %04x:%04x  not fully enumerated, handed off to the daemon\n",
+                   gPlans->plans[i].idVendor, gPlans->plans[i].idProduct);
+    }
+    
+    if( nDone == nDevices && nEnumerated == gPlans->nPlans )
+        return 0;
+    if( handOff(&run, states, nDevices, enumerated) ) {
+        printf("Could not hand off to the daemon\n");
+        return 1;
+    }
+    return 2;
+}
+
+
+//================================================================================================
+// Daemon side of the hand-off
+//
+
+// The device at a given location, if it is still there
+static io_service_t findDeviceAt(const WritePlan *plan, UInt32 locationID)
+{
+    CFMutableDictionaryRef     matchingDictionary = 0;
+    io_iterator_t            iterator = 0;
+    io_service_t            usbDeviceRef, found = 0;
+    
+    if( makeDictionary( &matchingDictionary, plan->idVendor, plan->idProduct ) ||
+        gBus->getMatchingServices(kIOMasterPortDefault, matchingDictionary, &iterator) )
+        return 0;
+    while ( (usbDeviceRef = gBus->iteratorNext(iterator)) ) {
+        if( !found && getDeviceLocation(usbDeviceRef) == locationID )
+            found = usbDeviceRef;
+        else
+            gBus->objectRelease(usbDeviceRef);
+    }
+    gBus->objectRelease(iterator);
+    return found;
+}
+
+static void retryHandoff(void *context)
+{
+    HandoffRetry        *retry = (HandoffRetry *) context;
+    const WritePlan        *plan;
+    io_service_t        usbDevice;
+    int                    err;
+    
+    // Its workers may still be writing to the device
+    if( retry->pid && retry->exitWait < kHandoffExitWait && ownerAlive(retry->pid) ) {
+        retry->exitWait++;
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC), dispatch_get_main_queue(),
+                         retry, retryHandoff);
+        return;
+    }
+    // An apply it left unfinished is finished or undone before the next one
+    if( retry->pid && gJournalFd >= 0 )
+        compactJournal(1);
+    retry->pid = 0;
+    
+    plan = findPlan(gPlans, retry->idVendor, retry->idProduct);
+    if( plan && retry->locationID == 0 ) {
+        // A device type the one-shot run could not enumerate: rescan it
+        if(gVerbose)
+            fprintf(stderr, "Activating devices %04x:%04x handed off by a one-shot run\n",
+                    retry->idVendor, retry->idProduct);
+        activatePlan(kIOMasterPortDefault, plan);
+        free(retry);
+        return;
+    }
+    usbDevice = plan ? findDeviceAt(plan, retry->locationID) : 0;
+    
+    // If it was unplugged, DeviceAdded takes care of it when it comes back
+    if( !usbDevice ) {
+        free(retry);
+        return;
+    }
+    if(gVerbose)
+        fprintf(stderr, "Activating device %08x handed off by a one-shot run\n", (unsigned)retry->locationID);
+    err = dealWithDeviceAttempts(usbDevice, plan, 1);    // the retries below are far enough apart
+    gBus->objectRelease(usbDevice);
+    
+    if( err && --retry->attemptsLeft > 0 ) {
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, kHandoffRetryDelay * NSEC_PER_SEC),
+                         dispatch_get_main_queue(), retry, retryHandoff);
+        return;
+    }
+    if( err )
+        fprintf(stderr, "Giving up on device %08x\n", (unsigned)retry->locationID);
+    free(retry);
+}
+
+// Take the hand-offs out of the file and schedule them, or just empty it if discard is set
+static void readHandoffs(int fd, int discard)
+{
+    char        text[kMaxHandoffSize + 1];
+    ssize_t        len;
+    
+    flock(fd, LOCK_EX);
+    len = pread(fd, text, kMaxHandoffSize, 0);
+    ftruncate(fd, 0);
+    flock(fd, LOCK_UN);
+    if( len <= 0 || discard )
+        return;
+    text[len] = '\0';
+    
+    for( char *line = text; *line; ) {
+        unsigned    locationID, idVendor, idProduct;
+        int            pid = 0;
+        
+        if( sscanf(line, "%x %x:%x %d", &locationID, &idVendor, &idProduct, &pid) >= 3 ) {
+            HandoffRetry *retry = malloc(sizeof(HandoffRetry));
+            retry->locationID = locationID;
+            retry->idVendor = (UInt16)idVendor;
+            retry->idProduct = (UInt16)idProduct;
+            retry->pid = pid;
+            retry->exitWait = 0;
+            retry->attemptsLeft = kHandoffAttempts;
+            dispatch_async_f(dispatch_get_main_queue(), retry, retryHandoff);
+        }
+        line += strcspn(line, "\n");
+        if( *line )
+            line++;
+    }
+}
+
+int WatchHandoffFile(int discard);
+
+static void handoffWatchCancelled(void *context)
+{
+    close((int)(intptr_t)context);
+}
+
+static void handoffFileChanged(void *context)
+{
+    unsigned long flags = dispatch_source_get_data(gHandoffWatch);
+    
+    // Somebody cleaned up /var/run: start over with a new file
+    if( flags & (DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME) ) {
+        dispatch_source_cancel(gHandoffWatch);
+        dispatch_release(gHandoffWatch);
+        gHandoffWatch = NULL;
+        WatchHandoffFile(0);
+        return;
+    }
+    readHandoffs((int)(intptr_t)context, 0);
+}
+
+// At startup the hand-offs are discarded, as every device present has just been activated anyway
+int WatchHandoffFile(int discard)
+{
+    int fd = open(kHandoffPath, O_RDWR | O_CREAT, 0644);
+    
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s, one-shot runs cannot hand off devices\n", kHandoffPath);
+        return -1;
+    }
+    gHandoffWatch = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, fd,
+                                           DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND | DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME,
+                                           dispatch_get_main_queue());
+    if (!gHandoffWatch) {
+        close(fd);
+        return -1;
+    }
+    dispatch_set_context(gHandoffWatch, (void *)(intptr_t)fd);
+    dispatch_source_set_event_handler_f(gHandoffWatch, handoffFileChanged);
+    dispatch_source_set_cancel_handler_f(gHandoffWatch, handoffWatchCancelled);
+    dispatch_resume(gHandoffWatch);
+    readHandoffs(fd, discard);
+    return 0;
+}
+
+
+//================================================================================================
+//
+//    Simulated CM6206
+//
+//    Just enough of a device to accept register writes, used by the stress harness (-S) and
+//    the capture replay (-r). The stress harness reaches it through the simulated I/O Kit below.
+//    Opens, writes and notification requests fail at random with the device's fault rate.
+//
+//================================================================================================
+
+static UInt64 gSimRandomState = 1;
+
+void simSeed(UInt64 seed)
+{
+    gSimRandomState = seed ? seed : 1;
+}
+
+// xorshift64*, so runs can be reproduced with the same seed
+double simRandom(void)
+{
+    gSimRandomState ^= gSimRandomState >> 12;
+    gSimRandomState ^= gSimRandomState << 25;
+    gSimRandomState ^= gSimRandomState >> 27;
+    return (double)((gSimRandomState * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+int simRandomInt(int n)
+{
+    return (int)(simRandom() * n);
+}
+
+
+static int simOpen(SimDevice *dev)
+{
+    if( simRandom() < dev->faultRate ) {
+        dev->nFaults++;
+        return kIOReturnExclusiveAccess;
+    }
+    dev->openCount++;
+    return 0;
+}
+
+static void simClose(SimDevice *dev)
+{
+    dev->openCount--;
+}
+
+static int simWriteRegisters(void *ref, UInt8 byte1, UInt8 byte2, UInt8 regNo)
+{
+    SimDevice *dev = (SimDevice *) ref;
+    
+    if( dev->openCount <= 0 || simRandom() < dev->faultRate ) {
+        dev->nFaults++;
+        return 1;
+    }
+    dev->regs[regNo] = byte1 | (byte2 << 8);
+    dev->written[regNo] = 1;
+    dev->nWrites++;
+    return 0;
+}
+
+//================================================================================================
+// Simulated I/O Kit
+//
+// Implements the calls in CM6206Bus and the USB device and interface interfaces that
+// dealWithDevice() and dealWithInterface() use, for the devices in gSimDevices. Object
+// references and open handles are counted, so the stress harness can tell whether the daemon
+// code leaks any. An object name encodes its kind and the index of its device.
+//
+#define kSimKindMask            0xF0000000
+#define kSimIndexMask            0x0FFFFFFF
+#define kSimService                0x10000000    // | device index
+#define kSimInterface            0x20000000    // | device index * kSimInterfaces + interface number
+#define kSimIterator            0x30000000    // | iterator slot
+#define kSimNotification        0x40000000    // | device index
+#define kSimInterfaces            4
+#define kMaxSimIterators        64
+
+typedef struct SimIterator {
+    int                        n, pos;
+    io_object_t                objects[];
+} SimIterator;
+
+// Plug-in, device interface or interface interface. The vtable comes first, so a pointer to
+// the object also is the handle (**) the interface functions get.
+typedef struct SimUSBObject {
+    const void                *vtbl;
+    SimDevice                *dev;
+    int                        interfaceNo;    // -1 for the device
+    int                        isOpen;
+} SimUSBObject;
+
+static SimDevice                *gSimDevices;
+static int                        gSimNumDevices;
+static SimIterator                *gSimIterators[kMaxSimIterators];
+static int                        gSimObjectRefs;        // references to I/O Kit objects handed out
+static int                        gSimLiveUSBObjects;    // plug-ins and interfaces not released
+static int                        gSimReleasedOpen;    // interfaces released while still open
+static UInt64                    gSimActivations, gSimFailedActivations;
+static UInt64                    gSimHalfConfigured;    // failed activations that changed registers anyway
+
+
+static SimDevice *simDeviceOf(io_object_t object)
+{
+    UInt32 index = object & kSimIndexMask;
+    
+    switch( object & kSimKindMask ) {
+        case kSimInterface:
+            index /= kSimInterfaces;
+            // fall through
+        case kSimService:
+        case kSimNotification:
+            if( index < (UInt32)gSimNumDevices )
+                return &gSimDevices[index];
+    }
+    return NULL;
+}
+
+static io_iterator_t simNewIterator(const io_object_t *objects, int n)
+{
+    for( int slot=0; slot<kMaxSimIterators; slot++ ) {
+        if( gSimIterators[slot] )
+            continue;
+        gSimIterators[slot] = malloc(sizeof(SimIterator) + n * sizeof(io_object_t));
+        gSimIterators[slot]->n = n;
+        gSimIterators[slot]->pos = 0;
+        memcpy(gSimIterators[slot]->objects, objects, n * sizeof(io_object_t));
+        gSimObjectRefs++;
+        return kSimIterator | slot;
+    }
+    return 0;
+}
+
+static kern_return_t simGetMatchingServices(mach_port_t masterPort, CFDictionaryRef matching, io_iterator_t *iterator)
+{
+    SInt32            idVendor = -1, idProduct = -1;
+    io_object_t        *found = malloc(gSimNumDevices * sizeof(io_object_t));
+    int                n = 0;
+    
+    CFNumberGetValue(CFDictionaryGetValue(matching, CFSTR(kUSBVendorID)), kCFNumberSInt32Type, &idVendor);
+    CFNumberGetValue(CFDictionaryGetValue(matching, CFSTR(kUSBProductID)), kCFNumberSInt32Type, &idProduct);
+    CFRelease(matching);    // consumed, like the real one does
+    for( int i=0; i<gSimNumDevices; i++ ) {
+        if( gSimDevices[i].attached && gSimDevices[i].idVendor == idVendor && gSimDevices[i].idProduct == idProduct )
+            found[n++] = kSimService | i;
+    }
+    *iterator = simNewIterator(found, n);
+    free(found);
+    return *iterator ? KERN_SUCCESS : kIOReturnNoResources;
+}
+
+static io_object_t simIteratorNext(io_iterator_t iterator)
+{
+    SimIterator *it = (iterator & kSimKindMask) == kSimIterator ? gSimIterators[iterator & (kMaxSimIterators - 1)] : NULL;
+    
+    if( !it || it->pos >= it->n )
+        return 0;
+    gSimObjectRefs++;
+    return it->objects[it->pos++];
+}
+
+static kern_return_t simObjectRelease(io_object_t object)
+{
+    SimDevice *dev = simDeviceOf(object);
+    
+    switch( object & kSimKindMask ) {
+        case kSimIterator:
+            if( !gSimIterators[object & (kMaxSimIterators - 1)] )
+                return kIOReturnBadArgument;
+            free(gSimIterators[object & (kMaxSimIterators - 1)]);
+            gSimIterators[object & (kMaxSimIterators - 1)] = NULL;
+            break;
+        case kSimNotification:
+            // Releasing the notification object unregisters it
+            if( !dev || dev->notification != object )
+                return kIOReturnBadArgument;
+            dev->notification = 0;
+            break;
+        case kSimService:
+        case kSimInterface:
+            if( !dev )
+                return kIOReturnBadArgument;
+            break;
+        default:
+            return kIOReturnBadArgument;
+    }
+    gSimObjectRefs--;
+    return KERN_SUCCESS;
+}
+
+static kern_return_t simGetName(io_registry_entry_t entry, char *name)
+{
+    if( !simDeviceOf(entry) )
+        return kIOReturnBadArgument;
+    strcpy(name, "Simulated CM6206");
+    return KERN_SUCCESS;
+}
+
+static CFTypeRef simCreateProperty(io_registry_entry_t entry, CFStringRef key, CFAllocatorRef allocator, IOOptionBits options)
+{
+    SimDevice *dev = simDeviceOf(entry);
+    SInt64 value;
+    
+    if( !dev )
+        return NULL;
+    if( CFEqual(key, CFSTR(kUSBVendorID)) )
+        value = dev->idVendor;
+    else if( CFEqual(key, CFSTR(kUSBProductID)) )
+        value = dev->idProduct;
+    else if( CFEqual(key, CFSTR(kUSBDevicePropertyLocationID)) )
+        value = dev->locationID;
+    else
+        return NULL;
+    return CFNumberCreate(allocator, kCFNumberSInt64Type, &value);
+}
+
+static kern_return_t simAddInterestNotification(IONotificationPortRef notifyPort, io_service_t service,
+                                                const char *interestType, IOServiceInterestCallback callback,
+                                                void *refCon, io_object_t *notification)
+{
+    SimDevice *dev = simDeviceOf(service);
+    
+    if( !dev || !dev->attached )
+        return kIOReturnNoDevice;
+    if( simRandom() < dev->faultRate ) {
+        dev->nFaults++;
+        return kIOReturnNoResources;
+    }
+    dev->notification = kSimNotification | (UInt32)(dev - gSimDevices);
+    dev->notifyCallback = callback;
+    dev->notifyRefCon = refCon;
+    gSimObjectRefs++;
+    *notification = dev->notification;
+    return KERN_SUCCESS;
+}
+
+
+// Did the activation that just ended leave the device with its plan applied?
+static int simPlanApplied(const SimDevice *dev)
+{
+    const WritePlan *plan = findPlan(gPlans, dev->idVendor, dev->idProduct);
+    
+    if( !plan )
+        return 0;
+    for( int w=0; w<plan->nWrites; w++ ) {
+        const CM6206Write *write = &plan->writes[w];
+        UInt16 expected = write->byte1 | (write->byte2 << 8);
+        
+        // The last write to a register wins
+        for( int x=w+1; x<plan->nWrites; x++ ) {
+            if( plan->writes[x].regNo == write->regNo )
+                expected = plan->writes[x].byte1 | (plan->writes[x].byte2 << 8);
+        }
+        if( !dev->written[write->regNo] || dev->regs[write->regNo] != expected )
+            return 0;
+    }
+    return 1;
+}
+
+static SimUSBObject *simNewUSBObject(const void *vtbl, SimDevice *dev, int interfaceNo)
+{
+    SimUSBObject *object = calloc(1, sizeof(SimUSBObject));
+    
+    object->vtbl = vtbl;
+    object->dev = dev;
+    object->interfaceNo = interfaceNo;
+    gSimLiveUSBObjects++;
+    return object;
+}
+
+static const IOUSBDeviceInterface kSimDeviceInterface;
+static const IOUSBInterfaceInterface183 kSimInterfaceInterface;
+
+static HRESULT simQueryInterface(void *self, REFIID iid, LPVOID *ppv)
+{
+    SimUSBObject *plugin = (SimUSBObject *) self;
+    
+    if( plugin->interfaceNo < 0 ) {
+        *ppv = simNewUSBObject(&kSimDeviceInterface, plugin->dev, -1);
+        // An activation starts: forget what earlier ones wrote
+        bzero(plugin->dev->written, sizeof(plugin->dev->written));
+        memcpy(plugin->dev->regsBefore, plugin->dev->regs, sizeof(plugin->dev->regs));
+        plugin->dev->nFaultsBefore = plugin->dev->nFaults;
+    }
+    else
+        *ppv = simNewUSBObject(&kSimInterfaceInterface, plugin->dev, plugin->interfaceNo);
+    return 0;
+}
+
+static ULONG simAddRef(void *self)
+{
+    return 1;
+}
+
+static ULONG simRelease(void *self)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    
+    if( object->isOpen )
+        gSimReleasedOpen++;
+    if( object->vtbl == &kSimDeviceInterface ) {
+        gSimActivations++;
+        if( !simPlanApplied(object->dev) ) {
+            gSimFailedActivations++;
+            // A failed activation must leave the registers as they were, unless the rollback
+            // was hit by a fault of its own
+            if( object->dev->nFaults - object->dev->nFaultsBefore <= 1 &&
+                memcmp(object->dev->regs, object->dev->regsBefore, sizeof(object->dev->regs)) )
+                gSimHalfConfigured++;
+        }
+    }
+    free(object);
+    gSimLiveUSBObjects--;
+    return 0;
+}
+
+static const IOCFPlugInInterface kSimPlugIn = {
+    .QueryInterface = simQueryInterface, .AddRef = simAddRef, .Release = simRelease
+};
+
+static IOReturn simCreatePlugInInterface(io_service_t service, CFUUIDRef pluginType, CFUUIDRef interfaceType,
+                                         IOCFPlugInInterface ***plugin, SInt32 *score)
+{
+    SimDevice *dev = simDeviceOf(service);
+    
+    *plugin = NULL;
+    if( !dev || !dev->attached )
+        return kIOReturnNoDevice;
+    *plugin = (IOCFPlugInInterface **) simNewUSBObject(&kSimPlugIn, dev,
+                                                       (service & kSimKindMask) == kSimInterface ?
+                                                       (int)((service & kSimIndexMask) % kSimInterfaces) : -1);
+    *score = 0;
+    return kIOReturnSuccess;
+}
+
+static const CM6206Bus kSimBus = {
+    simGetMatchingServices, simIteratorNext, simObjectRelease, simGetName,
+    simCreateProperty, simAddInterestNotification, simCreatePlugInInterface
+};
+
+
+// The device interface
+static IOReturn simUSBDeviceOpen(void *self)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    IOReturn err;
+    
+    if( !object->dev->attached )
+        return kIOReturnNoDevice;
+    if( object->isOpen )
+        return kIOReturnExclusiveAccess;
+    if( (err = simOpen(object->dev)) )
+        return err;
+    object->isOpen = 1;
+    return kIOReturnSuccess;
+}
+
+static IOReturn simUSBDeviceClose(void *self)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    
+    if( !object->isOpen )
+        return kIOReturnNotOpen;
+    simClose(object->dev);
+    object->isOpen = 0;
+    return kIOReturnSuccess;
+}
+
+static IOReturn simGetNumberOfConfigurations(void *self, UInt8 *numConfig)
+{
+    *numConfig = 1;
+    return kIOReturnSuccess;
+}
+
+static IOReturn simGetConfigurationDescriptorPtr(void *self, UInt8 configIndex, IOUSBConfigurationDescriptorPtr *desc)
+{
+    static IOUSBConfigurationDescriptor config = { .bConfigurationValue = 1 };
+    
+    if( configIndex != 0 )
+        return kIOUSBConfigNotFound;
+    *desc = &config;
+    return kIOReturnSuccess;
+}
+
+static IOReturn simSetConfiguration(void *self, UInt8 configNum)
+{
+    return ((SimUSBObject *) self)->isOpen ? kIOReturnSuccess : kIOReturnNotOpen;
+}
+
+static IOReturn simCreateInterfaceIterator(void *self, IOUSBFindInterfaceRequest *req, io_iterator_t *iter)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    io_object_t interfaces[kSimInterfaces];
+    UInt32 index = (UInt32)(object->dev - gSimDevices);
+    
+    for( int i=0; i<kSimInterfaces; i++ )
+        interfaces[i] = kSimInterface | (index * kSimInterfaces + i);
+    *iter = simNewIterator(interfaces, kSimInterfaces);
+    return *iter ? kIOReturnSuccess : kIOReturnNoResources;
+}
+
+static IOReturn simGetLocationID(void *self, UInt32 *locationID)
+{
+    *locationID = ((SimUSBObject *) self)->dev->locationID;
+    return kIOReturnSuccess;
+}
+
+static const IOUSBDeviceInterface kSimDeviceInterface = {
+    .QueryInterface = simQueryInterface, .AddRef = simAddRef, .Release = simRelease,
+    .USBDeviceOpen = simUSBDeviceOpen, .USBDeviceClose = simUSBDeviceClose,
+    .GetNumberOfConfigurations = simGetNumberOfConfigurations,
+    .GetConfigurationDescriptorPtr = simGetConfigurationDescriptorPtr,
+    .SetConfiguration = simSetConfiguration, .CreateInterfaceIterator = simCreateInterfaceIterator,
+    .GetLocationID = simGetLocationID
+};
+
+
+// The interface interface
+static IOReturn simUSBInterfaceOpen(void *self)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    
+    if( !object->dev->attached )
+        return kIOReturnNoDevice;
+    if( object->isOpen )
+        return kIOReturnExclusiveAccess;
+    if( simRandom() < object->dev->faultRate ) {
+        object->dev->nFaults++;
+        return kIOReturnExclusiveAccess;    // in use by the audio driver
+    }
+    object->isOpen = 1;
+    object->dev->interfaceOpenCount++;
+    return kIOReturnSuccess;
+}
+
+static IOReturn simUSBInterfaceClose(void *self)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    
+    if( !object->isOpen )
+        return kIOReturnNotOpen;
+    object->isOpen = 0;
+    object->dev->interfaceOpenCount--;
+    return kIOReturnSuccess;
+}
+
+// Only the register writes of writeCM6206Registers() are understood
+static IOReturn simControlRequest(void *self, UInt8 pipeRef, IOUSBDevRequest *req)
+{
+    SimUSBObject *object = (SimUSBObject *) self;
+    const UInt8 *buf = (const UInt8 *) req->pData;
+    
+    if( !object->isOpen )
+        return kIOReturnNotOpen;
+    if( req->bmRequestType != 0x21 || req->bRequest != 0x09 || req->wValue != 0x0200 ||
+        req->wIndex != 3 || req->wLength != 4 || buf[0] != 0x20 )
+        return kIOReturnBadArgument;
+    if( simWriteRegisters(object->dev, buf[1], buf[2], buf[3]) )
+        return kIOUSBTransactionTimeout;
+    return kIOReturnSuccess;
+}
+
+static IOReturn simClearPipeStall(void *self, UInt8 pipeRef)
+{
+    return kIOReturnSuccess;
+}
+
+static IOReturn simGetNumEndpoints(void *self, UInt8 *intfNumEndpoints)
+{
+    *intfNumEndpoints = 0;
+    return kIOReturnSuccess;
+}
+
+static const IOUSBInterfaceInterface183 kSimInterfaceInterface = {
+    .QueryInterface = simQueryInterface, .AddRef = simAddRef, .Release = simRelease,
+    .USBInterfaceOpen = simUSBInterfaceOpen, .USBInterfaceOpenSeize = simUSBInterfaceOpen,
+    .USBInterfaceClose = simUSBInterfaceClose, .ControlRequest = simControlRequest,
+    .ClearPipeStall = simClearPipeStall, .GetNumEndpoints = simGetNumEndpoints
+};
+
+
+//================================================================================================
+//
+//    Stress harness (-S)
+//
+//    Runs the daemon's device handling against thousands of simulated devices on a real run
+//    loop, with gBus switched to the simulated I/O Kit: devices arrive in batches through
+//    DeviceAdded, leave through the DeviceNotification it registered, and wake storms go through
+//    powerCallback and ActivateDevices. Faults are injected into opens, writes and notification
+//    requests, and a few devices never open at all.
+//    Activations are deferred to the main queue as in daemon mode. A probe timer measures how
+//    long the run loop is kept busy. All plan delays are divided by the time scale, so one
+//    simulated second of settling costs a millisecond, but the lag is reported in plan time,
+//    i.e. as the daemon would see it with the delays at full length.
+//
+//    Options are a comma-separated list, e.g. -S devices=2000,seconds=30,faults=0.05
+//
+//================================================================================================
+
+#define kStressProbeInterval    0.010        // s
+#define kStressChaosInterval    0.005        // s
+#define kStressMaxBatch            8            // devices per simulated DeviceAdded callback
+#define kStressWakeChance        0.005        // per chaos tick
+#define kStressRemoveChance        0.1            // chance a picked attached device is unplugged
+
+typedef struct StressOptions {
+    int                        nDevices;
+    double                    seconds;
+    double                    faultRate;
+    double                    stuckRate;        // devices that never open
+    int                        timeScale;
+    UInt64                    seed;
+    double                    maxLagMs;        // pass/fail limits
+    double                    maxMemoryKB;
+    double                    minThroughput;    // activations per second spent activating
+    int                        maxLeakedPorts;
+} StressOptions;
+
+typedef struct StressState {
+    StressOptions            opt;
+    const WritePlan            *plan;
+    SimDevice                *devices;
+    int                        nAttached, peakAttached;
+    int                        nextArrival;    // devices not yet plugged in during ramp-up
+    UInt64                    hotplugs, removals, wakeStorms, wakes;
+    double                    callbackSeconds;    // spent in DeviceAdded, powerCallback and activations
+    CFAbsoluteTime            lastProbe;
+    UInt64                    lastWaitedMs;
+    double                    maxLag, totalLag;
+    UInt64                    nProbes;
+} StressState;
+
+
+static size_t mallocInUse(void)
+{
+    malloc_statistics_t stats;
+    
+    malloc_zone_statistics(NULL, &stats);
+    return stats.size_in_use;
+}
+
+static int countMachPorts(void)
+{
+    mach_port_name_array_t    names;
+    mach_port_type_array_t    types;
+    mach_msg_type_number_t    nNames, nTypes;
+    
+    if( mach_port_names(mach_task_self(), &names, &nNames, &types, &nTypes) != KERN_SUCCESS )
+        return -1;
+    vm_deallocate(mach_task_self(), (vm_address_t)names, nNames * sizeof(*names));
+    vm_deallocate(mach_task_self(), (vm_address_t)types, nTypes * sizeof(*types));
+    return (int)nNames;
+}
+
+
+// Plug in devices and hand them to DeviceAdded in one iterator, like after a hub reconnect
+static void stressDevicesAdded(StressState *st, SimDevice **devs, int n)
+{
+    io_object_t services[kStressMaxBatch];
+    io_iterator_t iterator;
+    CFAbsoluteTime start;
+    
+    for( int i=0; i<n; i++ ) {
+        // A few devices are stuck and will never open, the rest fail now and then
+        devs[i]->faultRate = simRandom() < st->opt.stuckRate ? 1.0 : st->opt.faultRate;
+        devs[i]->attached = 1;
+        services[i] = kSimService | (UInt32)(devs[i] - gSimDevices);
+        if( ++st->nAttached > st->peakAttached )
+            st->peakAttached = st->nAttached;
+        st->hotplugs++;
+    }
+    iterator = simNewIterator(services, n);
+    start = CFAbsoluteTimeGetCurrent();
+    DeviceAdded(NULL, iterator);
+    st->callbackSeconds += CFAbsoluteTimeGetCurrent() - start;
+    simObjectRelease(iterator);
+}
+
+// Unplug a device; the daemon hears of it through its interest notification, if it got one
+static void stressDeviceRemoved(StressState *st, SimDevice *dev)
+{
+    dev->attached = 0;
+    if( dev->notification )
+        dev->notifyCallback(dev->notifyRefCon, kSimService | (UInt32)(dev - gSimDevices),
+                            kIOMessageServiceIsTerminated, NULL);
+    dev->locationID += 0x10000;        // it comes back as a new device
+    st->nAttached--;
+    st->removals++;
+}
+
+static void stressWake(StressState *st)
+{
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    st->wakes++;
+    powerCallback(NULL, 0, kIOMessageSystemHasPoweredOn, NULL);
+    st->callbackSeconds += CFAbsoluteTimeGetCurrent() - start;
+}
+
+
+void stressChaosTick(CFRunLoopTimerRef timer, void *info)
+{
+    StressState *st = (StressState *) info;
+    SimDevice *batch[kStressMaxBatch];
+    int nBatch = 0;
+    
+    // First everything gets plugged in, a batch per tick like after a concentrator reconnect
+    if( st->nextArrival < st->opt.nDevices ) {
+        while( nBatch < kStressMaxBatch && st->nextArrival < st->opt.nDevices )
+            batch[nBatch++] = &st->devices[st->nextArrival++];
+        stressDevicesAdded(st, batch, nBatch);
+        return;
+    }
+    
+    if( simRandom() < kStressWakeChance ) {
+        // Several wake notifications in a row, as seen with flaky USB-over-IP links
+        int n = 1 + simRandomInt(5);
+        st->wakeStorms++;
+        while( n-- > 0 )
+            stressWake(st);
+        return;
+    }
+    
+    // One batch of hotplug events
+    for( int n = simRandomInt(kStressMaxBatch + 1); n > 0; n-- ) {
+        SimDevice *dev = &st->devices[simRandomInt(st->opt.nDevices)];
+        int queued = 0;
+        for( int i=0; i<nBatch && !queued; i++ )
+            queued = batch[i] == dev;
+        if( !dev->attached && !queued )
+            batch[nBatch++] = dev;
+        else if( dev->attached && !queued && simRandom() < kStressRemoveChance )
+            stressDeviceRemoved(st, dev);
+    }
+    if( nBatch )
+        stressDevicesAdded(st, batch, nBatch);
+}
+
+void stressProbeTick(CFRunLoopTimerRef timer, void *info)
+{
+    StressState *st = (StressState *) info;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    UInt64 waitedMs = gWaitedMs;
+    
+    if( st->lastProbe ) {
+        double lag = now - st->lastProbe - kStressProbeInterval;
+        // The plan delays in between only took 1/timeScale of their length
+        lag += (waitedMs - st->lastWaitedMs) / 1000.0 * (1 - 1.0 / st->opt.timeScale);
+        if( lag < 0 )
+            lag = 0;
+        if( lag > st->maxLag )
+            st->maxLag = lag;
+        st->totalLag += lag;
+        st->nProbes++;
+    }
+    st->lastProbe = now;
+    st->lastWaitedMs = waitedMs;
+}
+
+
+static int parseStressOptions(const char *spec, StressOptions *opt)
+{
+    char *copy = strdup(spec), *item, *save = NULL;
+    int err = 0;
+    
+    opt->nDevices = 1000;
+    opt->seconds = 10;
+    opt->faultRate = 0.01;
+    opt->stuckRate = 0.001;
+    opt->timeScale = 1000;
+    opt->seed = 1;
+    opt->maxLagMs = 250;
+    opt->maxMemoryKB = 256;
+    opt->minThroughput = 500;
+    opt->maxLeakedPorts = 2;        // Core Foundation may lazily create a port or two
+    
+    for( item = strtok_r(copy, ",", &save); item && !err; item = strtok_r(NULL, ",", &save) ) {
+        char *value = strchr(item, '=');
+        const char *key = item;
+        double v;
+        
+        if( !value ) {
+            // A bare number is the device count
+            value = item;
+            key = "devices";
+        }
+        else
+            *value++ = '\0';
+        v = strtod(value, NULL);
+        if( strcmp(key, "devices") == 0 && v >= 1 )
+            opt->nDevices = (int)v;
+        else if( strcmp(key, "seconds") == 0 && v > 0 )
+            opt->seconds = v;
+        else if( strcmp(key, "faults") == 0 && v >= 0 && v <= 1 )
+            opt->faultRate = v;
+        else if( strcmp(key, "stuck") == 0 && v >= 0 && v <= 1 )
+            opt->stuckRate = v;
+        else if( strcmp(key, "timescale") == 0 && v >= 1 )
+            opt->timeScale = (int)v;
+        else if( strcmp(key, "seed") == 0 )
+            opt->seed = strtoull(value, NULL, 0);
+        else if( strcmp(key, "lag") == 0 && v > 0 )
+            opt->maxLagMs = v;
+        else if( strcmp(key, "memory") == 0 && v >= 0 )
+            opt->maxMemoryKB = v;
+        else if( strcmp(key, "throughput") == 0 && v >= 0 )
+            opt->minThroughput = v;
+        else if( strcmp(key, "ports") == 0 && v >= 0 )
+            opt->maxLeakedPorts = (int)v;
+        else {
+            fprintf(stderr, "Invalid stress option `%s'\n", key);
+            err = 1;
+        }
+    }
+    free(copy);
+    return err ? -1 : 0;
+}
+
+
+static int stressCheck(const char *what, int pass)
+{
+    printf("  %-60s %s\n", what, pass ? "PASS" : "FAIL");
+    return pass;
+}
+
+int RunStressTest(const char *spec)
+{
+    StressState                st;
+    CFRunLoopTimerContext    context;
+    CFRunLoopTimerRef        probeTimer, chaosTimer;
+    CFAbsoluteTime            start;
+    size_t                    memBefore, memAfter;
+    int                        portsBefore, portsAfter, liveBefore, openHandles = 0, mismatches = 0, pass = 1;
+    int                        staleShadows = 0;
+    int                        savedStderr = -1;
+    UInt64                    activationsBefore, failedBefore, halfBefore, activations, failed;
+    double                    elapsed, throughput, memGrowthKB, activationSecondsBefore;
+    CFAbsoluteTime            drainEnd;
+    char                    line[128];
+    
+    bzero(&st, sizeof(st));
+    if( parseStressOptions(spec, &st.opt) )
+        return 2;
+    st.plan = &gPlans->plans[0];
+    simSeed(st.opt.seed);
+    gTimeScale = st.opt.timeScale;
+    gDeferActivations = 1;
+    
+    st.devices = calloc(st.opt.nDevices, sizeof(SimDevice));
+    gSimDevices = st.devices;
+    gSimNumDevices = st.opt.nDevices;
+    gBus = &kSimBus;
+    for( int i=0; i<st.opt.nDevices; i++ ) {
+        st.devices[i].locationID = 0x14000000 + i;
+        st.devices[i].idVendor = st.plan->idVendor;
+        st.devices[i].idProduct = st.plan->idProduct;
+    }
+    
+    bzero(&context, sizeof(context));
+    context.info = &st;
+    probeTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + kStressProbeInterval,
+                                      kStressProbeInterval, 0, 0, stressProbeTick, &context);
+    chaosTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + kStressChaosInterval,
+                                      kStressChaosInterval, 0, 0, stressChaosTick, &context);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), probeTimer, kCFRunLoopDefaultMode);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), chaosTimer, kCFRunLoopDefaultMode);
+    
+    printf("Stress test: %d devices (%04x:%04x, profile '%s'), %.0f s, faults %.3f, stuck %.3f, time scale 1/%d, seed %llu\n",
+           st.opt.nDevices, st.plan->idVendor, st.plan->idProduct, st.plan->profile, st.opt.seconds,
+           st.opt.faultRate, st.opt.stuckRate, st.opt.timeScale, (unsigned long long)st.opt.seed);
+    fflush(stdout);
+    
+    // Injected faults produce a lot of error messages, only show them in verbose mode
+    if( !gVerbose ) {
+        int devNull = open("/dev/null", O_WRONLY);
+        savedStderr = dup(STDERR_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
+    }
+    
+    memBefore = mallocInUse();
+    portsBefore = countMachPorts();
+    liveBefore = gLivePrivateData;
+    activationsBefore = gSimActivations;
+    failedBefore = gSimFailedActivations;
+    halfBefore = gSimHalfConfigured;
+    activationSecondsBefore = gActivationSeconds;
+    start = CFAbsoluteTimeGetCurrent();
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, st.opt.seconds, false);
+    stressProbeTick(probeTimer, &st);    // the last callback may have overrun the end
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+    st.callbackSeconds += gActivationSeconds - activationSecondsBefore;
+    
+    // What the daemon believes it wrote must be what the devices have, rollbacks included
+    for( int i=0; i<st.opt.nDevices; i++ ) {
+        SimDevice *dev = &st.devices[i];
+        DeviceShadow *shadow = dev->attached ? findShadow(dev->locationID, 0) : NULL;
+        for( int r=0; shadow && r<kCM6206NumRegisters; r++ ) {
+            if( shadow->known[r] && shadow->regs[r] != dev->regs[r] ) {
+                mismatches++;
+                break;
+            }
+        }
+    }
+    
+    activations = gSimActivations - activationsBefore;
+    failed = gSimFailedActivations - failedBefore;
+    
+    // Unplug everything, after which nothing of the devices should be left
+    for( int i=0; i<st.opt.nDevices; i++ ) {
+        if( st.devices[i].attached )
+            stressDeviceRemoved(&st, &st.devices[i]);
+    }
+    
+    // The activations still pending fail on the unplugged devices and drop their references;
+    // any left after that count as leaked references
+    CFRunLoopTimerInvalidate(probeTimer);
+    CFRunLoopTimerInvalidate(chaosTimer);
+    drainEnd = CFAbsoluteTimeGetCurrent() + 10;
+    while( gPendingActivations > 0 && CFAbsoluteTimeGetCurrent() < drainEnd )
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, kStressProbeInterval, false);
+    
+    for( int i=0; i<st.opt.nDevices; i++ )
+        openHandles += st.devices[i].openCount + st.devices[i].interfaceOpenCount;
+    openHandles += gSimLiveUSBObjects + gSimReleasedOpen;
+    pthread_mutex_lock(&gShadowLock);
+    for( DeviceShadow *shadow = gShadows; shadow; shadow = shadow->next )
+        staleShadows++;
+    pthread_mutex_unlock(&gShadowLock);
+    memAfter = mallocInUse();
+    portsAfter = countMachPorts();
+    
+    if( savedStderr >= 0 ) {
+        dup2(savedStderr, STDERR_FILENO);
+        close(savedStderr);
+    }
+    CFRelease(probeTimer);
+    CFRelease(chaosTimer);
+    gBus = &kIOKitBus;
+    gSimDevices = NULL;
+    gSimNumDevices = 0;
+    free(st.devices);
+    gTimeScale = 1;
+    gDeferActivations = 0;
+    
+    throughput = st.callbackSeconds > 0 ? activations / st.callbackSeconds : 0;
+    memGrowthKB = memAfter > memBefore ? (memAfter - memBefore) / 1024.0 : 0;
+    
+    printf("  %d devices attached at peak\n", st.peakAttached);
+    printf("  %llu hotplugs, %llu removals, %llu wake storms (%llu wakes) in %.1f s\n",
+           (unsigned long long)st.hotplugs, (unsigned long long)st.removals,
+           (unsigned long long)st.wakeStorms, (unsigned long long)st.wakes, elapsed);
+    printf("  %llu activations, %llu failed\n", (unsigned long long)activations, (unsigned long long)failed);
+    
+    snprintf(line, sizeof(line), "event loop lag in plan time: max %.1f ms, mean %.2f ms (limit %.0f ms)",
+             st.maxLag * 1000, st.nProbes ? st.totalLag * 1000 / st.nProbes : 0.0, st.opt.maxLagMs);
+    pass &= stressCheck(line, st.maxLag * 1000 <= st.opt.maxLagMs);
+    snprintf(line, sizeof(line), "activation throughput: %.0f/s (limit %.0f/s)", throughput, st.opt.minThroughput);
+    pass &= stressCheck(line, throughput >= st.opt.minThroughput);
+    snprintf(line, sizeof(line), "memory growth: %.1f KB (limit %.0f KB)", memGrowthKB, st.opt.maxMemoryKB);
+    pass &= stressCheck(line, memGrowthKB <= st.opt.maxMemoryKB);
+    snprintf(line, sizeof(line), "devices whose registers differ from the shadow: %d", mismatches);
+    pass &= stressCheck(line, mismatches == 0);
+    snprintf(line, sizeof(line), "failed activations that left a device half-configured: %llu",
+             (unsigned long long)(gSimHalfConfigured - halfBefore));
+    pass &= stressCheck(line, gSimHalfConfigured == halfBefore);
+    snprintf(line, sizeof(line), "shadows left of unplugged devices: %d", staleShadows);
+    pass &= stressCheck(line, staleShadows == 0);
+    snprintf(line, sizeof(line), "leaked private data: %d", gLivePrivateData - liveBefore);
+    pass &= stressCheck(line, gLivePrivateData == liveBefore);
+    snprintf(line, sizeof(line), "leaked device handles: %d", openHandles);
+    pass &= stressCheck(line, openHandles == 0);
+    snprintf(line, sizeof(line), "leaked I/O Kit object references: %d", gSimObjectRefs);
+    pass &= stressCheck(line, gSimObjectRefs == 0);
+    snprintf(line, sizeof(line), "leaked mach ports: %d (limit %d)", portsAfter - portsBefore, st.opt.maxLeakedPorts);
+    pass &= stressCheck(line, portsAfter - portsBefore <= st.opt.maxLeakedPorts);
+    printf("Result: %s\n", pass ? "PASS" : "FAIL");
+    
+    return pass ? 0 : 1;
+}
+
+
+//================================================================================================
+//
+//    Capture replay (-r)
+//
+//    Reads a USB capture of a vendor driver talking to a CM6206 and picks out the register
+//    writes, i.e. the class-specific SET_REPORT requests that writeCM6206Registers() sends
+//    (bmRequestType 0x21, bRequest 0x09, wValue 0x0200, wIndex 3, data 0x20 b1 b2 reg).
+//    Those are replayed against a simulated device and the resulting registers, order and
+//    timing are compared with each configured profile.
+//
+//    Supported are pcap and pcapng files with Linux usbmon (link types 189, 220) or USBPcap
+//    (249) packets, and the text output of usbmon (/sys/kernel/debug/usb/usbmon/<bus>u).
+//
+//================================================================================================
+
+#define kLinkTypeUsbLinux            189
+#define kLinkTypeUsbLinuxMmapped    220
+#define kLinkTypeUsbPcap            249
+#define kMaxCaptureSize                (256 * 1024 * 1024)
+#define kMaxCaptureDevices            16
+#define kMaxPcapngInterfaces        16
+#define kUsbPcapPending                16
+#define kReplayGapWarnMs            20.0    // pauses longer than this may matter to the chip
+
+typedef struct CapturedWrite {
+    double                    t;                // seconds since the first packet
+    UInt32                    device;            // bus << 16 | device address
+    CM6206Write                write;
+} CapturedWrite;
+
+typedef struct Capture {
+    CapturedWrite            *writes;
+    int                        nWrites, maxWrites;
+    int                        nPackets;
+    double                    t0;
+    struct {                                // USBPcap SETUP stages still waiting for their data
+        UInt64                irpId;
+        UInt32                device;
+        double                t;
+        UInt8                setup[8];
+    } pending[kUsbPcapPending];
+    int                        nextPending;
+} Capture;
+
+
+static UInt16 rd16(const UInt8 *p, int bigEndian)
+{
+    return bigEndian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static UInt32 rd32(const UInt8 *p, int bigEndian)
+{
+    return bigEndian ? ((UInt32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+                     : p[0] | (p[1] << 8) | (p[2] << 16) | ((UInt32)p[3] << 24);
+}
+
+static UInt64 rd64le(const UInt8 *p)
+{
+    return rd32(p, 0) | ((UInt64)rd32(p + 4, 0) << 32);
+}
+
+
+// Keep the transfer if it is a CM6206 register write
+static void captureSetReport(Capture *cap, double t, UInt32 device, const UInt8 *setup,
+                             const UInt8 *data, UInt32 dataLen)
+{
+    CapturedWrite *w;
+    
+    if( setup[0] != 0x21 || setup[1] != 0x09 || rd16(setup + 2, 0) != 0x0200 || rd16(setup + 4, 0) != 0x03 )
+        return;
+    if( dataLen < 4 || data[0] != 0x20 )
+        return;
+    if( cap->nWrites == cap->maxWrites ) {
+        cap->maxWrites = cap->maxWrites ? cap->maxWrites * 2 : 64;
+        cap->writes = realloc(cap->writes, cap->maxWrites * sizeof(CapturedWrite));
+    }
+    w = &cap->writes[cap->nWrites++];
+    w->t = t;
+    w->device = device;
+    w->write.byte1 = data[1];
+    w->write.byte2 = data[2];
+    w->write.regNo = data[3];
+}
+
+// Count a packet and make its timestamp relative to the first one
+static double capturedAt(Capture *cap, double t)
+{
+    if( cap->t0 < 0 )
+        cap->t0 = t;
+    cap->nPackets++;
+    return t - cap->t0;
+}
+
+static void capturePacket(Capture *cap, int linkType, double t, const UInt8 *p, UInt32 len)
+{
+    t = capturedAt(cap, t);
+    
+    if( linkType == kLinkTypeUsbLinux || linkType == kLinkTypeUsbLinuxMmapped ) {
+        UInt32 hdrLen = linkType == kLinkTypeUsbLinux ? 48 : 64;
+        UInt32 dataLen;
+        
+        // Submission ('S') of a control transfer (2) that carries a setup packet (flag 0)
+        if( len < hdrLen || p[8] != 'S' || p[9] != 2 || p[14] != 0 )
+            return;
+        dataLen = rd32(p + 36, 0);
+        if( dataLen > len - hdrLen )
+            dataLen = len - hdrLen;
+        captureSetReport(cap, t, ((UInt32)rd16(p + 12, 0) << 16) | p[11], p + 40, p + hdrLen, dataLen);
+    }
+    else if( linkType == kLinkTypeUsbPcap ) {
+        UInt16 hdrLen;
+        UInt64 irpId;
+        UInt32 device;
+        const UInt8 *payload;
+        UInt32 payLen;
+        
+        // 27 byte header plus the stage byte of control transfers
+        if( len < 28 || (hdrLen = rd16(p, 0)) < 28 || hdrLen > len )
+            return;
+        // Only control transfers (2) going to the device (info bit 0 clear)
+        if( p[22] != 2 || (p[16] & 1) )
+            return;
+        irpId = rd64le(p + 2);
+        device = ((UInt32)rd16(p + 17, 0) << 16) | rd16(p + 19, 0);
+        payload = p + hdrLen;
+        payLen = len - hdrLen;
+        
+        if( p[27] == 0 && payLen >= 8 ) {
+            // SETUP stage; the data of an OUT transfer may be appended or come separately
+            if( payLen > 8 )
+                captureSetReport(cap, t, device, payload, payload + 8, payLen - 8);
+            else {
+                int slot = cap->nextPending++ % kUsbPcapPending;
+                cap->pending[slot].irpId = irpId;
+                cap->pending[slot].device = device;
+                cap->pending[slot].t = t;
+                memcpy(cap->pending[slot].setup, payload, 8);
+            }
+        }
+        else if( p[27] == 1 ) {
+            // DATA stage
+            for( int i=0; i<kUsbPcapPending; i++ ) {
+                if( cap->pending[i].irpId == irpId && cap->pending[i].device == device ) {
+                    captureSetReport(cap, cap->pending[i].t, device, cap->pending[i].setup, payload, payLen);
+                    cap->pending[i].irpId = 0;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+//================================================================================================
+// File formats
+//
+static int readPcap(const UInt8 *buf, size_t size, Capture *cap)
+{
+    UInt32 magic = rd32(buf, 0);
+    int bigEndian, nano;
+    int linkType;
+    size_t off = 24;
+    
+    if( size < 24 )
+        return -1;
+    bigEndian = !(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d);
+    nano = rd32(buf, bigEndian) == 0xa1b23c4d;
+    linkType = (int)rd32(buf + 20, bigEndian);
+    
+    while( off + 16 <= size ) {
+        UInt32 sec = rd32(buf + off, bigEndian);
+        UInt32 frac = rd32(buf + off + 4, bigEndian);
+        UInt32 caplen = rd32(buf + off + 8, bigEndian);
+        
+        off += 16;
+        if( caplen > size - off ) {
+            fprintf(stderr, "Capture is truncated\n");
+            break;
+        }
+        capturePacket(cap, linkType, sec + frac * (nano ? 1e-9 : 1e-6), buf + off, caplen);
+        off += caplen;
+    }
+    return 0;
+}
+
+static int readPcapng(const UInt8 *buf, size_t size, Capture *cap)
+{
+    int linkTypes[kMaxPcapngInterfaces];
+    double tsUnit[kMaxPcapngInterfaces];
+    UInt32 snapLens[kMaxPcapngInterfaces];
+    int nInterfaces = 0, bigEndian = 0;
+    size_t off = 0;
+    
+    while( off + 12 <= size ) {
+        UInt32 type = rd32(buf + off, bigEndian);
+        UInt32 blockLen;
+        const UInt8 *b = buf + off;
+        
+        if( type == 0x0A0D0D0A ) {
+            // Section header: its byte order magic tells how to read everything that follows
+            if( rd32(b + 8, 0) == 0x1A2B3C4D )
+                bigEndian = 0;
+            else if( rd32(b + 8, 1) == 0x1A2B3C4D )
+                bigEndian = 1;
+            else
+                return -1;
+            nInterfaces = 0;
+        }
+        blockLen = rd32(b + 4, bigEndian);
+        if( blockLen < 12 || (blockLen & 3) || blockLen > size - off ) {
+            fprintf(stderr, "Capture is truncated or corrupt\n");
+            break;
+        }
+        
+        if( type == 1 && blockLen >= 20 && nInterfaces < kMaxPcapngInterfaces ) {
+            // Interface description: link type, snap length and timestamp resolution
+            size_t opt = 16;
+            linkTypes[nInterfaces] = rd16(b + 8, bigEndian);
+            snapLens[nInterfaces] = rd32(b + 12, bigEndian);
+            tsUnit[nInterfaces] = 1e-6;
+            while( opt + 4 <= blockLen - 4 ) {
+                UInt16 code = rd16(b + opt, bigEndian), optLen = rd16(b + opt + 2, bigEndian);
+                if( code == 0 || opt + 4 + optLen > blockLen - 4 )
+                    break;
+                if( code == 9 && optLen >= 1 ) {    // if_tsresol
+                    UInt8 v = b[opt + 4];
+                    tsUnit[nInterfaces] = (v & 0x80) ? pow(2, -(v & 0x7f)) : pow(10, -v);
+                }
+                opt += 4 + ((optLen + 3) & ~3);
+            }
+            nInterfaces++;
+        }
+        else if( type == 6 && blockLen >= 32 ) {
+            // Enhanced packet
+            UInt32 ifId = rd32(b + 8, bigEndian);
+            UInt64 ts = ((UInt64)rd32(b + 12, bigEndian) << 32) | rd32(b + 16, bigEndian);
+            UInt32 caplen = rd32(b + 20, bigEndian);
+            if( ifId < (UInt32)nInterfaces && caplen <= blockLen - 32 )
+                capturePacket(cap, linkTypes[ifId], ts * tsUnit[ifId], b + 28, caplen);
+        }
+        else if( type == 3 && blockLen >= 16 && nInterfaces > 0 ) {
+            // Simple packet: always interface 0, no timestamp
+            UInt32 caplen = rd32(b + 8, bigEndian);
+            if( caplen > blockLen - 16 )
+                caplen = blockLen - 16;
+            if( snapLens[0] && caplen > snapLens[0] )
+                caplen = snapLens[0];
+            capturePacket(cap, linkTypes[0], 0, b + 12, caplen);
+        }
+        off += blockLen;
+    }
+    return 0;
+}
+
+// usbmon text: "<tag> <usec> S Co:<bus>:<dev>:<ep> s 21 09 0200 0003 0004 4 = 20000480"
+static int readUsbmonText(const char *text, Capture *cap)
+{
+    const char *p = text;
+    char line[1024];
+    
+    while( *p ) {
+        size_t len = strcspn(p, "\n");
+        char *tok[32], *s, *save = NULL;
+        int nTok = 0;
+        double t;
+        
+        if( len >= sizeof(line) )
+            len = sizeof(line) - 1;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p += strcspn(p, "\n");
+        if( *p )
+            p++;
+        
+        for( s = strtok_r(line, " \t\r", &save); s && nTok < 32; s = strtok_r(NULL, " \t\r", &save) )
+            tok[nTok++] = s;
+        if( nTok < 3 )
+            continue;
+        t = capturedAt(cap, strtoul(tok[1], NULL, 10) * 1e-6);
+        if( nTok >= 12 && strcmp(tok[2], "S") == 0 && strncmp(tok[3], "Co:", 3) == 0 && strcmp(tok[4], "s") == 0
+           && strcmp(tok[11], "=") == 0 ) {
+            UInt8 setup[8], data[64];
+            UInt32 dataLen = 0, device;
+            unsigned long wValue = strtoul(tok[7], NULL, 16), wIndex = strtoul(tok[8], NULL, 16);
+            unsigned long wLength = strtoul(tok[9], NULL, 16);
+            char *field = tok[3] + 3, *next;
+            unsigned long a = strtoul(field, &next, 10), b = 0;
+            
+            // Newer kernels print bus:dev:ep, older ones dev:ep
+            if( *next == ':' && strchr(next + 1, ':') )
+                b = strtoul(next + 1, NULL, 10);
+            else {
+                b = a;
+                a = 0;
+            }
+            device = ((UInt32)a << 16) | (UInt32)b;
+            
+            setup[0] = (UInt8)strtoul(tok[5], NULL, 16);
+            setup[1] = (UInt8)strtoul(tok[6], NULL, 16);
+            setup[2] = wValue & 0xff;
+            setup[3] = (wValue >> 8) & 0xff;
+            setup[4] = wIndex & 0xff;
+            setup[5] = (wIndex >> 8) & 0xff;
+            setup[6] = wLength & 0xff;
+            setup[7] = (wLength >> 8) & 0xff;
+            for( int i=12; i<nTok; i++ ) {
+                for( const char *h = tok[i]; h[0] && h[1] && dataLen < sizeof(data); h += 2 ) {
+                    char hex[3] = { h[0], h[1], '\0' };
+                    data[dataLen++] = (UInt8)strtoul(hex, NULL, 16);
+                }
+            }
+            captureSetReport(cap, t, device, setup, data, dataLen);
+        }
+    }
+    return 0;
+}
+
+int readCapture(const char *path, Capture *cap)
+{
+    FILE *f;
+    UInt8 *buf;
+    size_t size;
+    UInt32 magic;
+    int nRet;
+    
+    f = fopen(path, "rb");
+    if( !f ) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if( size > kMaxCaptureSize ) {
+        fprintf(stderr, "%s: file too large\n", path);
+        fclose(f);
+        return -1;
+    }
+    buf = malloc(size + 1);
+    size = fread(buf, 1, size, f);
+    fclose(f);
+    buf[size] = '\0';
+    
+    bzero(cap, sizeof(Capture));
+    cap->t0 = -1;
+    magic = size >= 4 ? rd32(buf, 0) : 0;
+    if( magic == 0x0A0D0D0A )
+        nRet = readPcapng(buf, size, cap);
+    else if( magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1 )
+        nRet = readPcap(buf, size, cap);
+    else
+        nRet = readUsbmonText((const char *)buf, cap);
+    free(buf);
+    if( nRet )
+        fprintf(stderr, "%s: unrecognised capture format\n", path);
+    return nRet;
+}
+
+
+//================================================================================================
+// Replay and compare
+//
+static void simApply(SimDevice *dev, const CM6206Write *writes, int nWrites)
+{
+    simOpen(dev);
+    for( int w=0; w<nWrites; w++ )
+        simWriteRegisters(dev, writes[w].byte1, writes[w].byte2, writes[w].regNo);
+    simClose(dev);
+}
+
+// Returns 1 if the registers of both devices are the same
+static int diffRegisters(const SimDevice *captured, const SimDevice *profile, int print)
+{
+    int same = 1;
+    
+    for( int r=0; r<kCM6206NumRegisters; r++ ) {
+        if( captured->written[r] == profile->written[r] &&
+            (!captured->written[r] || captured->regs[r] == profile->regs[r]) )
+            continue;
+        same = 0;
+        if( !print )
+            continue;
+        printf("      reg 0x%02x: capture ", r);
+        if( captured->written[r] )
+            printf("0x%04x", captured->regs[r]);
+        else
+            printf("(not written)");
+        printf(", profile ");
+        if( profile->written[r] )
+            printf("0x%04x\n", profile->regs[r]);
+        else
+            printf("(not written)\n");
     }
+    return same;
+}
+
+static int replayDevice(const Capture *cap, UInt32 device)
+{
+    CM6206Write *writes = malloc(cap->nWrites * sizeof(CM6206Write));
+    SimDevice *captured = calloc(1, sizeof(SimDevice));
+    double first = -1, last = 0, prev = 0, maxGap = 0, start, replayTime;
+    int nWrites = 0, nLongGaps = 0, matched = 0;
     
-    IOObjectRelease(iterator);
-    iterator = 0;
+    printf("Device %u:%u\n", device >> 16, device & 0xffff);
+    for( int i=0; i<cap->nWrites; i++ ) {
+        const CapturedWrite *w = &cap->writes[i];
+        if( w->device != device )
+            continue;
+        if( first < 0 )
+            first = prev = w->t;
+        if( w->t - prev > maxGap )
+            maxGap = w->t - prev;
+        if( (w->t - prev) * 1000 > kReplayGapWarnMs )
+            nLongGaps++;
+        printf("  %+10.3f ms  write 0x%02x 0x%02x 0x%02x%s\n", (w->t - first) * 1000,
+               w->write.byte1, w->write.byte2, w->write.regNo,
+               (w->t - prev) * 1000 > kReplayGapWarnMs ? "   <- long pause before this write" : "");
+        prev = last = w->t;
+        writes[nWrites++] = w->write;
+    }
     
-    err = (*dev)->USBDeviceClose(dev);
-    if (err) {
-        fprintf(stderr, "dealWithDevice: error closing device - %08x\n", err);
-        (*dev)->Release(dev);
-        return;
+    // Full speed, no pauses
+    start = CFAbsoluteTimeGetCurrent();
+    simApply(captured, writes, nWrites);
+    replayTime = CFAbsoluteTimeGetCurrent() - start;
+    printf("  %d writes over %.3f ms in the capture (longest pause %.3f ms), replayed in %.3f ms\n",
+           nWrites, (last - first) * 1000, maxGap * 1000, replayTime * 1000);
+    
+    for( int i=0; i<gPlans->nPlans; i++ ) {
+        const WritePlan *plan = &gPlans->plans[i];
+        SimDevice *profile;
+        int sameRegs, sameOrder, seen = 0;
+        
+        // Several devices may share a profile
+        for( int j=0; j<i && !seen; j++ )
+            seen = strcmp(gPlans->plans[j].profile, plan->profile) == 0;
+        if( seen )
+            continue;
+        
+        profile = calloc(1, sizeof(SimDevice));
+        simApply(profile, plan->writes, plan->nWrites);
+        sameRegs = diffRegisters(captured, profile, 0);
+        sameOrder = nWrites == plan->nWrites && memcmp(writes, plan->writes, nWrites * sizeof(CM6206Write)) == 0;
+        printf("  vs. profile '%s': registers %s, sequence %s\n", plan->profile,
+               sameRegs ? "MATCH" : "DIFFER", sameOrder ? "MATCH" : "DIFFERS");
+        if( !sameRegs )
+            diffRegisters(captured, profile, 1);
+        if( !sameOrder && sameRegs )
+            printf("      same end state, but %d writes in the capture vs. %d in the profile\n", nWrites, plan->nWrites);
+        if( nLongGaps )
+            printf("      timing: the capture pauses %d time(s) for more than %.0f ms, the profile writes back to back\n",
+                   nLongGaps, kReplayGapWarnMs);
+        matched |= sameRegs;
+        free(profile);
     }
-    err = (*dev)->Release(dev);
-    if (err) {
-        fprintf(stderr, "dealWithDevice: error releasing device - %08x\n", err);
-        return;
+    
+    printf("  As a profile:\n    profile captured-%u-%u\n", device >> 16, device & 0xffff);
+    for( int w=0; w<nWrites; w++ )
+        printf("        write 0x%02x 0x%02x 0x%02x\n", writes[w].byte1, writes[w].byte2, writes[w].regNo);
+    
+    free(captured);
+    free(writes);
+    return matched;
+}
+
+
+// Returns 0 if every device in the capture ends up like one of the profiles
+int ReplayCapture(const char *path)
+{
+    Capture cap;
+    UInt32 devices[kMaxCaptureDevices];
+    int nDevices = 0, nIgnored = 0, allMatched = 1;
+    
+    if( readCapture(path, &cap) )
+        return 2;
+    for( int i=0; i<cap.nWrites; i++ ) {
+        int known = 0;
+        for( int d=0; d<nDevices && !known; d++ )
+            known = devices[d] == cap.writes[i].device;
+        if( !known && nDevices < kMaxCaptureDevices )
+            devices[nDevices++] = cap.writes[i].device;
+        else if( !known )
+            nIgnored++;
+    }
+    printf("%s: %d packets, %d CM6206 register writes to %d device(s)\n", path, cap.nPackets, cap.nWrites, nDevices);
+    if( nIgnored ) {
+        // Not replayed, so the capture cannot be said to match
+        fprintf(stderr, "%d register writes to devices beyond the first %d were ignored\n", nIgnored, kMaxCaptureDevices);
+        allMatched = 0;
+    }
+    if( nDevices == 0 ) {
+        free(cap.writes);
+        return 1;
     }
+    for( int d=0; d<nDevices; d++ )
+        allMatched &= replayDevice(&cap, devices[d]);
+    free(cap.writes);
+    return allMatched ? 0 : 1;
 }
 
 
 //================================================================================================
 //
-//    DeviceNotification
+//    Capture level monitor
 //
-//    This routine will get called whenever any kIOGeneralInterest notification happens.  We are
-//    interested in the kIOMessageServiceIsTerminated message so that's what we look for.  Other
-//    messages are defined in IOMessage.h.
+//    In daemon mode with -m, every Core Audio input device that belongs to a CM6206 gets an
+//    AudioQueue that delivers 100 ms blocks of float samples. Each block is reduced to peak,
+//    RMS, DC offset and clip count per channel with vDSP, and the result is stored in a shared
+//    memory page. Nothing else is done with the audio, so this costs next to nothing.
 //
 //================================================================================================
-void DeviceNotification(void *refCon, io_service_t service, natural_t messageType, void *messageArgument)
+
+// Create (or recreate) the shared stats page. Returns 0 on success.
+int openStatsPage(void)
 {
-    kern_return_t    kr;
-    MyPrivateData    *privateDataRef = (MyPrivateData *) refCon;
+    int fd;
+    size_t size = (sizeof(CM6206StatsPage) + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
     
-    if (messageType == kIOMessageServiceIsTerminated) {
-        if(gVerbose) {
-            fprintf(stderr, "CM6206 device removed.\n");
-            // Dump our private data just to see what it looks like.
-            fprintf(stderr, "privateDataRef->deviceName: ");
-            CFShow(privateDataRef->deviceName);
-        }
-        
-        // Free the data we're no longer using now that the device is going away
-        CFRelease(privateDataRef->deviceName);
-        
-        if (privateDataRef->deviceInterface) {
-            kr = (*privateDataRef->deviceInterface)->Release(privateDataRef->deviceInterface);
-        }
-        
-        kr = IOObjectRelease(privateDataRef->notification);
-        
-        free(privateDataRef);
+    // A stale object from a previous run cannot be resized on OS X, so start from scratch.
+    shm_unlink(kStatsShmName);
+    fd = shm_open(kStatsShmName, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("openStatsPage: shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror("openStatsPage: ftruncate");
+        close(fd);
+        return -1;
     }
+    gStatsPage = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (gStatsPage == MAP_FAILED) {
+        perror("openStatsPage: mmap");
+        gStatsPage = NULL;
+        return -1;
+    }
+    bzero(gStatsPage, size);
+    gStatsPage->version = kStatsVersion;
+    gStatsPage->nDevices = kMaxMonitoredDevices;
+    gStatsPage->nChannels = kMonitorChannels;
+    gStatsPage->sampleRate = (uint32_t)kMonitorSampleRate;
+    gStatsPage->blockFrames = kMonitorBufferFrames;
+    atomic_thread_fence(memory_order_release);
+    gStatsPage->magic = kStatsMagic;
+    return 0;
+}
+
+
+// Seqlock around updates of one entry, so readers never see a half-written block.
+static void beginLevelsUpdate(CM6206DeviceLevels *levels)
+{
+    uint32_t seq = atomic_load_explicit(&levels->seq, memory_order_relaxed);
+    atomic_store_explicit(&levels->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void endLevelsUpdate(CM6206DeviceLevels *levels)
+{
+    uint32_t seq = atomic_load_explicit(&levels->seq, memory_order_relaxed);
+    atomic_store_explicit(&levels->seq, seq + 1, memory_order_release);
 }
 
 
 //================================================================================================
+// Reduce one block of interleaved samples to per-channel levels. All kernels are vDSP, which
+// works on the strided channel data directly so there's no need to deinterleave first.
 //
-//    DeviceAdded
-//
-//    This routine is the callback for our IOServiceAddMatchingNotification.  When we get called
-//    we will look at all the devices that were added and we will:
-//
-//    1.  Create some private data to relate to each device
-//    2.  Submit an IOServiceAddInterestNotification of type kIOGeneralInterest for this device,
-//        using the refCon field to store a pointer to our private data.  When we get called with
-//        this interest notification, we can grab the refCon and access our private data.
-//  3.  Run the CM6206 activation routine.
-//
-//================================================================================================
-void DeviceAdded(void *refCon, io_iterator_t iterator)
+void measureLevels(const float *samples, UInt32 nFrames, CM6206DeviceLevels *levels, float *scratch)
 {
-    kern_return_t        kr;
-    io_service_t        usbDevice;
+    const float lo = -kClipLevel, hi = kClipLevel;
     
-    while ((usbDevice = IOIteratorNext(iterator))) {
-        io_name_t        deviceName;
-        CFStringRef        deviceNameAsCFString;
-        MyPrivateData    *privateDataRef = NULL;
-        
-        fprintf(stderr, "CM6206 device added.\n");
-        
-        // Add some app-specific information about this device.
-        // Create a buffer to hold the data.
-        privateDataRef = malloc(sizeof(MyPrivateData));
-        bzero(privateDataRef, sizeof(MyPrivateData));
-        
-        // Get the USB device's name.
-        kr = IORegistryEntryGetName(usbDevice, deviceName);
-        if (KERN_SUCCESS != kr) {
-            deviceName[0] = '\0';
-        }
-        
-        deviceNameAsCFString = CFStringCreateWithCString(kCFAllocatorDefault, deviceName,
-                                                         kCFStringEncodingASCII);
-        
-        // Dump our data to stderr just to see what it looks like.
-        if(gVerbose) {
-            fprintf(stderr, "deviceName: ");
-            CFShow(deviceNameAsCFString);
-        }
-        
-        // Save the device's name to our private data.
-        privateDataRef->deviceName = deviceNameAsCFString;
-        
-        // Register for an interest notification of this device being removed. Use a reference to our
-        // private data as the refCon which will be passed to the notification callback.
-        kr = IOServiceAddInterestNotification(gNotifyPort,                        // notifyPort
-                                              usbDevice,                        // service
-                                              kIOGeneralInterest,                // interestType
-                                              DeviceNotification,                // callback
-                                              privateDataRef,                    // refCon
-                                              &(privateDataRef->notification)    // notification
-                                              );
-        
-        if (KERN_SUCCESS != kr) {
-            fprintf(stderr, "IOServiceAddInterestNotification returned 0x%08x.\n", kr);
-        }
-        
-        // This is not strictly necessary but it seems to avoid kernel panics when some
-        // third-party audio enhancers are active.
-        sleep(1);
-        
-        dealWithDevice(usbDevice);  // here the important stuff happens
+    beginLevelsUpdate(levels);
+    for( int c=0; c<kMonitorChannels; c++ ) {
+        CM6206ChannelLevels *ch = &levels->ch[c];
+        vDSP_Length nLow = 0, nHigh = 0;
         
-        // Done with this USB device; release the reference added by IOIteratorNext
-        kr = IOObjectRelease(usbDevice);
+        vDSP_maxmgv(samples + c, kMonitorChannels, &ch->peak, nFrames);
+        vDSP_rmsqv(samples + c, kMonitorChannels, &ch->rms, nFrames);
+        vDSP_meanv(samples + c, kMonitorChannels, &ch->dcOffset, nFrames);
+        // vclipc counts what it clips; the clipped copy itself goes to scratch and is ignored.
+        vDSP_vclipc(samples + c, kMonitorChannels, &lo, &hi, scratch, 1, nFrames, &nLow, &nHigh);
+        ch->clipsLast = (uint32_t)(nLow + nHigh);
+        ch->clipsTotal += nLow + nHigh;
     }
+    levels->blocks++;
+    levels->lastUpdate = time(NULL);
+    endLevelsUpdate(levels);
+}
+
+
+// AudioQueue input callback, runs on the queue's own thread.
+void monitorInputCallback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer,
+                          const AudioTimeStamp *inStartTime, UInt32 inNumPackets,
+                          const AudioStreamPacketDescription *inPacketDesc)
+{
+    MonitorSlot *slot = (MonitorSlot *) inUserData;
+    UInt32 nFrames = inBuffer->mAudioDataByteSize / (sizeof(float) * kMonitorChannels);
+    
+    if( nFrames > kMonitorBufferFrames )
+        nFrames = kMonitorBufferFrames;
+    if( nFrames > 0 )
+        measureLevels((const float *) inBuffer->mAudioData, nFrames, slot->levels, slot->scratch);
+    if( slot->running )
+        AudioQueueEnqueueBuffer(inAQ, inBuffer, 0, NULL);
 }
 
+
 //================================================================================================
+// Core Audio helpers
 //
-//    SignalHandler
-//
-//    This routine will get called when we interrupt the program (usually with a Ctrl-C from the
-//    command line).
-//
-//================================================================================================
-void SignalHandler( int sigraised )
+static CFStringRef copyDeviceString(AudioObjectID device, AudioObjectPropertySelector selector)
 {
-    if(gVerbose)
-        fprintf(stderr, "CM6206Init caught signal %d, exiting\n", sigraised);
+    AudioObjectPropertyAddress addr = { selector, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+    CFStringRef str = NULL;
+    UInt32 size = sizeof(str);
     
-    exit(0);
+    if( AudioObjectGetPropertyData(device, &addr, 0, NULL, &size, &str) != noErr )
+        return NULL;
+    return str;
+}
+
+static int deviceHasInput(AudioObjectID device)
+{
+    AudioObjectPropertyAddress addr = { kAudioDevicePropertyStreams, kAudioObjectPropertyScopeInput, kAudioObjectPropertyElementMaster };
+    UInt32 size = 0;
+    
+    if( AudioObjectGetPropertyDataSize(device, &addr, 0, NULL, &size) != noErr )
+        return 0;
+    return size > 0;
+}
+
+// USB audio devices have a model UID of the form "<product name>:<VID>:<PID>".
+// Any device type that has a write plan counts.
+static int isCM6206AudioDevice(AudioObjectID device)
+{
+    CFStringRef modelUID, ids;
+    int match;
+    
+    modelUID = copyDeviceString(device, kAudioDevicePropertyModelUID);
+    if( !modelUID )
+        return 0;
+    match = 0;
+    for( int i=0; i<gPlans->nPlans && !match; i++ ) {
+        ids = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR(":%04X:%04X"),
+                                       gPlans->plans[i].idVendor, gPlans->plans[i].idProduct);
+        match = CFStringFind(modelUID, ids, kCFCompareCaseInsensitive).location != kCFNotFound;
+        CFRelease(ids);
+    }
+    CFRelease(modelUID);
+    return match;
 }
 
 
 //================================================================================================
-// Make a matching dictionary to find all devices with the given vendor & product ID
+// Start or stop monitoring one input device
 //
-int makeDictionary( CFMutableDictionaryRef *matchingDictionary, SInt32 idVendor, SInt32 idProduct )
+void stopMonitor(MonitorSlot *slot)
 {
-    CFNumberRef            numberRef = 0;
+    slot->running = 0;
+    if (slot->queue) {
+        AudioQueueStop(slot->queue, true);    // synchronous: no more callbacks after this
+        AudioQueueDispose(slot->queue, true);
+        slot->queue = NULL;
+    }
+    if (slot->uid) {
+        CFRelease(slot->uid);
+        slot->uid = NULL;
+    }
+    beginLevelsUpdate(slot->levels);
+    slot->levels->active = 0;
+    endLevelsUpdate(slot->levels);
+}
+
+
+int startMonitor(MonitorSlot *slot, CFStringRef uid)
+{
+    AudioStreamBasicDescription fmt;
+    OSStatus err;
     
-    *matchingDictionary = IOServiceMatching(kIOUSBDeviceClassName);    // requires <IOKit/usb/IOUSBLib.h>
-    if (!*matchingDictionary) {
-        fprintf(stderr, "Error: Could not create matching dictionary\n");
+    bzero(&fmt, sizeof(fmt));
+    fmt.mSampleRate = kMonitorSampleRate;
+    fmt.mFormatID = kAudioFormatLinearPCM;
+    fmt.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+    fmt.mChannelsPerFrame = kMonitorChannels;
+    fmt.mBitsPerChannel = 32;
+    fmt.mFramesPerPacket = 1;
+    fmt.mBytesPerFrame = sizeof(float) * kMonitorChannels;
+    fmt.mBytesPerPacket = fmt.mBytesPerFrame;
+    
+    // NULL run loop: callbacks arrive on an internal AudioQueue thread, not on our run loop
+    err = AudioQueueNewInput(&fmt, monitorInputCallback, slot, NULL, NULL, 0, &slot->queue);
+    if (err) {
+        fprintf(stderr, "startMonitor: AudioQueueNewInput failed, err = %d\n", (int)err);
         return -1;
     }
-    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &idVendor);
-    if (!numberRef) {
-        fprintf(stderr, "Error: Could not create CFNumberRef for vendor\n");
+    err = AudioQueueSetProperty(slot->queue, kAudioQueueProperty_CurrentDevice, &uid, sizeof(uid));
+    if (err) {
+        fprintf(stderr, "startMonitor: unable to select input device, err = %d\n", (int)err);
+        AudioQueueDispose(slot->queue, true);
+        slot->queue = NULL;
         return -1;
     }
-    CFDictionaryAddValue(*matchingDictionary, CFSTR(kUSBVendorID), numberRef);
-    CFRelease(numberRef);
-    numberRef = 0;
-    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &idProduct);
-    if (!numberRef) {
-        fprintf(stderr, "Error: Could not create CFNumberRef for product\n");
-        return -1;
+    for( int b=0; b<kMonitorNumBuffers; b++ ) {
+        AudioQueueBufferRef buffer;
+        err = AudioQueueAllocateBuffer(slot->queue, kMonitorBufferFrames * fmt.mBytesPerFrame, &buffer);
+        if (!err)
+            err = AudioQueueEnqueueBuffer(slot->queue, buffer, 0, NULL);
+        if (err) {
+            fprintf(stderr, "startMonitor: unable to set up buffers, err = %d\n", (int)err);
+            AudioQueueDispose(slot->queue, true);
+            slot->queue = NULL;
+            return -1;
+        }
     }
-    CFDictionaryAddValue(*matchingDictionary, CFSTR(kUSBProductID), numberRef);
-    CFRelease(numberRef);
-    numberRef = 0;
     
+    beginLevelsUpdate(slot->levels);
+    bzero(slot->levels->ch, sizeof(slot->levels->ch));
+    slot->levels->blocks = 0;
+    slot->levels->lastUpdate = 0;
+    CFStringGetCString(uid, slot->levels->uid, sizeof(slot->levels->uid), kCFStringEncodingUTF8);
+    slot->levels->active = 1;
+    endLevelsUpdate(slot->levels);
+    
+    slot->uid = CFRetain(uid);
+    slot->running = 1;
+    err = AudioQueueStart(slot->queue, NULL);
+    if (err) {
+        fprintf(stderr, "startMonitor: AudioQueueStart failed, err = %d\n", (int)err);
+        stopMonitor(slot);
+        return -1;
+    }
+    if(gVerbose) {
+        fprintf(stderr, "Monitoring capture levels of ");
+        CFShow(uid);
+    }
     return 0;
 }
 
-
 //================================================================================================
-// Look for all matching devices and deal with them once.
+// Bring the set of monitored devices in line with the CM6206 inputs Core Audio currently
+// knows about. Only ever called on the main thread.
 //
-int ActivateDevices()
+void MonitorRescan(void)
 {
-    kern_return_t        kr;
-    mach_port_t            masterPort = 0;    // requires <mach/mach.h>
-    CFMutableDictionaryRef     matchingDictionary = 0;    // requires <IOKit/IOKitLib.h>
-    io_iterator_t         iterator = 0;
-    io_service_t        usbDeviceRef;
-    int                    nRet, foundDevice = 0;
+    AudioObjectPropertyAddress addr = { kAudioHardwarePropertyDevices, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+    AudioObjectID *devices = NULL;
+    CFStringRef uids[kMaxMonitoredDevices];
+    int nFound = 0;
+    UInt32 size = 0;
     
-    kr = IOMasterPort(MACH_PORT_NULL, &masterPort);
-    if (kr) {
-        fprintf(stderr, "Error: Could not create master port, err = %08x\n", kr);
-        return kr;
+    if( AudioObjectGetPropertyDataSize(kAudioObjectSystemObject, &addr, 0, NULL, &size) == noErr && size ) {
+        devices = malloc(size);
+        if( AudioObjectGetPropertyData(kAudioObjectSystemObject, &addr, 0, NULL, &size, devices) != noErr )
+            size = 0;
     }
+    for( UInt32 d=0; d<size/sizeof(AudioObjectID) && nFound<kMaxMonitoredDevices; d++ ) {
+        if( deviceHasInput(devices[d]) && isCM6206AudioDevice(devices[d]) ) {
+            uids[nFound] = copyDeviceString(devices[d], kAudioDevicePropertyDeviceUID);
+            if( uids[nFound] )
+                nFound++;
+        }
+    }
+    free(devices);
     
-    nRet = makeDictionary( &matchingDictionary, kVendorID, kProductID );
-    if (nRet)
-        return nRet;
-    
-    kr = IOServiceGetMatchingServices(masterPort, matchingDictionary, &iterator);
-    matchingDictionary = 0;        // this was consumed by the above call
-    
-    while ( (usbDeviceRef = IOIteratorNext(iterator)) ) {
-        foundDevice = 1;
-        if(gVerbose)
-            fprintf(stderr, "CM6206 found (device %p)\n", (void*)usbDeviceRef);
-        dealWithDevice(usbDeviceRef);  // here the important stuff happens
-        IOObjectRelease(usbDeviceRef);    // no longer need this reference
+    // Stop monitors whose device went away
+    for( int s=0; s<kMaxMonitoredDevices; s++ ) {
+        int found = 0;
+        if( !gMonitorSlots[s].uid )
+            continue;
+        for( int f=0; f<nFound && !found; f++ )
+            found = CFEqual(gMonitorSlots[s].uid, uids[f]);
+        if( !found ) {
+            if(gVerbose)
+                fprintf(stderr, "Capture device gone, stopping monitor in slot %d\n", s);
+            stopMonitor(&gMonitorSlots[s]);
+        }
     }
-    if(! foundDevice && gVerbose)
-        fprintf(stderr, "No CM6206 device found on the USB bus.\n");
     
-    IOObjectRelease(iterator);
-    iterator = 0;
+    // Start monitors for new devices
+    for( int f=0; f<nFound; f++ ) {
+        int freeSlot = -1, known = 0;
+        for( int s=0; s<kMaxMonitoredDevices && !known; s++ ) {
+            if( gMonitorSlots[s].uid )
+                known = CFEqual(gMonitorSlots[s].uid, uids[f]);
+            else if( freeSlot < 0 )
+                freeSlot = s;
+        }
+        if( !known && freeSlot >= 0 )
+            startMonitor(&gMonitorSlots[freeSlot], uids[f]);
+        CFRelease(uids[f]);
+    }
+}
+
+
+static void monitorRescanOnMain(void *context)
+{
+    MonitorRescan();
+}
+
+// Called by Core Audio on one of its own threads whenever the device list changes
+OSStatus devicesChangedListener(AudioObjectID inObjectID, UInt32 inNumberAddresses,
+                                const AudioObjectPropertyAddress *inAddresses, void *inClientData)
+{
+    dispatch_async_f(dispatch_get_main_queue(), NULL, monitorRescanOnMain);
+    return noErr;
+}
+
+
+int StartLevelMonitor(void)
+{
+    AudioObjectPropertyAddress addr = { kAudioHardwarePropertyDevices, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+    OSStatus err;
     
-    mach_port_deallocate(mach_task_self(), masterPort);
+    if( openStatsPage() )
+        return -1;
+    for( int s=0; s<kMaxMonitoredDevices; s++ )
+        gMonitorSlots[s].levels = &gStatsPage->dev[s];
     
+    err = AudioObjectAddPropertyListener(kAudioObjectSystemObject, &addr, devicesChangedListener, NULL);
+    if (err) {
+        fprintf(stderr, "StartLevelMonitor: unable to watch the device list, err = %d\n", (int)err);
+        return -1;
+    }
+    MonitorRescan();
     return 0;
 }
 
 
 //================================================================================================
-// Callback for power events (sleep, wake).
+// -L: dump the stats page published by a running daemon
 //
-void powerCallback(void *rootPort, io_service_t y, natural_t msgType, void *msgArgument)
+static void printLevel(const char *what, float x)
 {
-    if( msgType == kIOMessageSystemHasPoweredOn ) {
-        if(gVerbose)
-            fprintf(stderr, "Waking from sleep, re-activating any CM6206 devices...\n");
-        sleep(1);
-        ActivateDevices();
+    if( x > 0.0f )
+        printf(" %s %6.1f dBFS", what, 20.0 * log10(x));
+    else
+        printf(" %s   -inf dBFS", what);
+}
+
+int PrintLevels(void)
+{
+    const CM6206StatsPage *page;
+    CM6206DeviceLevels levels;
+    int fd, nActive = 0;
+    
+    fd = shm_open(kStatsShmName, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No level statistics available (is the daemon running with -m?)\n");
+        return 1;
     }
-    else if( msgType == kIOMessageCanSystemSleep ||
-             msgType == kIOMessageSystemWillSleep ) {
-        // This case must be treated, otherwise the system will wait in vain for the program
-        // to allow sleep, and only sleep after a timeout.
-        IOAllowPowerChange(* (io_connect_t *) rootPort, (long) msgArgument);
+    page = mmap(NULL, sizeof(CM6206StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("PrintLevels: mmap");
+        return 1;
     }
+    if( page->magic != kStatsMagic || page->version != kStatsVersion ) {
+        fprintf(stderr, "Level statistics have an unknown format\n");
+        munmap((void *)page, sizeof(CM6206StatsPage));
+        return 1;
+    }
+    
+    for( int d=0; d<kMaxMonitoredDevices; d++ ) {
+        const CM6206DeviceLevels *src = &page->dev[d];
+        uint32_t seq1, seq2;
+        int nTries = 0;
+        
+        // Retry until we get a copy that was not being written to meanwhile. A daemon that died
+        // in the middle of an update leaves the sequence odd forever, so don't wait for it.
+        do {
+            if( nTries++ > 0 )
+                usleep(1000);
+            seq1 = atomic_load_explicit((_Atomic uint32_t *)&src->seq, memory_order_acquire);
+            memcpy(&levels, (const void *)src, sizeof(levels));
+            atomic_thread_fence(memory_order_acquire);
+            seq2 = atomic_load_explicit((_Atomic uint32_t *)&src->seq, memory_order_relaxed);
+        } while( ((seq1 & 1) || seq1 != seq2) && nTries < kStatsReadTries );
+        
+        if( (seq1 & 1) || seq1 != seq2 ) {
+            printf("Entry %d: stale (update never completed, daemon died?)\n", d);
+            continue;
+        }
+        if( !levels.active )
+            continue;
+        nActive++;
+        levels.uid[sizeof(levels.uid) - 1] = '\0';
+        printf("%s: %llu blocks, last update %lds ago\n", levels.uid, (unsigned long long)levels.blocks,
+               levels.lastUpdate ? (long)(time(NULL) - levels.lastUpdate) : -1L);
+        for( int c=0; c<kMonitorChannels; c++ ) {
+            const CM6206ChannelLevels *ch = &levels.ch[c];
+            printf("  ch%d:", c + 1);
+            printLevel("peak", ch->peak);
+            printLevel("rms", ch->rms);
+            printf(" dc %+.4f clips %u (total %llu)", ch->dcOffset, ch->clipsLast,
+                   (unsigned long long)ch->clipsTotal);
+            if( ch->peak == 0.0f )
+                printf(" SILENT");
+            else if( ch->clipsLast )
+                printf(" CLIPPING");
+            printf("\n");
+        }
+    }
+    if( !nActive )
+        printf("No CM6206 inputs are being monitored.\n");
+    
+    munmap((void *)page, sizeof(CM6206StatsPage));
+    return 0;
 }
 
 
@@ -685,11 +4233,22 @@ void powerCallback(void *rootPort, io_service_t y, natural_t msgType, void *msgA
 //
 int main(int argc, const char * argv[])
 {
-    int                    bDaemon = 0;
+    int                    bDaemon = 0, bMonitor = 0, bPrintPlans = 0;
+    const char            *stressSpec = NULL, *capturePath = NULL, *journalPath = NULL;
+    double                deadline = 0;
     sig_t                oldHandler;
     gVerbose = 1;
     
     for( int a=1; a<argc; a++ ) {
+        // Without this check a missing value would be reported as an unknown argument and
+        // the run would go on without it, e.g. with the built-in configuration.
+        if( a + 1 == argc && (strcmp( argv[a], "-c" ) == 0 || strcmp( argv[a], "-r" ) == 0 ||
+                              strcmp( argv[a], "-j" ) == 0 || strcmp( argv[a], "-t" ) == 0) ) {
+            fprintf(stderr, "Option %s needs a value\n", argv[a]);
+            printUsage(argv[0]);
+            return 1;
+        }
+        
         if( strcmp( argv[a], "-d" ) == 0 ) {
             bDaemon = 1;
             gVerbose = 0;
@@ -698,6 +4257,27 @@ int main(int argc, const char * argv[])
             gVerbose = 1;
         else if( strcmp( argv[a], "-s" ) == 0 )
             gVerbose = 0;
+        else if( strcmp( argv[a], "-m" ) == 0 )
+            bMonitor = 1;
+        else if( strcmp( argv[a], "-L" ) == 0 )
+            return PrintLevels();
+        else if( strcmp( argv[a], "-c" ) == 0 && a + 1 < argc )
+            gConfigPath = argv[++a];
+        else if( strcmp( argv[a], "-t" ) == 0 && a + 1 < argc ) {
+            deadline = strtod(argv[++a], NULL);
+            if( deadline <= 0 ) {
+                fprintf(stderr, "Invalid deadline `%s'\n", argv[a]);
+                return 1;
+            }
+        }
+        else if( strcmp( argv[a], "-j" ) == 0 && a + 1 < argc )
+            journalPath = argv[++a];
+        else if( strcmp( argv[a], "-P" ) == 0 )
+            bPrintPlans = 1;
+        else if( strcmp( argv[a], "-r" ) == 0 && a + 1 < argc )
+            capturePath = argv[++a];
+        else if( strcmp( argv[a], "-S" ) == 0 )
+            stressSpec = (a + 1 < argc && argv[a+1][0] != '-') ? argv[++a] : "";
         else if( strcmp( argv[a], "-V" ) == 0 ) {
             printf( "CM6206Init version %s\n", CMVERSION );
             return 0;
@@ -711,6 +4291,30 @@ int main(int argc, const char * argv[])
         }
     }
     
+    // Compile the configuration into write plans before anything else happens
+    gPlans = calloc(1, sizeof(PlanSet));
+    if( gConfigPath ? loadConfigFile(gConfigPath, gPlans)
+                    : parseConfig(kBuiltinConfig, "built-in configuration", gPlans) )
+        return 1;
+    if( bPrintPlans ) {
+        printPlans(gPlans);
+        return 0;
+    }
+    if( stressSpec )
+        return RunStressTest(stressSpec);
+    if( capturePath )
+        return ReplayCapture(capturePath);
+    
+    if( bMonitor && !bDaemon ) {
+        fprintf(stderr, "-m needs daemon mode (-d)\n");
+        return 1;
+    }
+    
+    // The daemon always journals its register writes, and so does a one-shot run with a
+    // deadline as it may leave applies unfinished. Other runs only if asked to.
+    if( journalPath || bDaemon || deadline > 0 )
+        OpenJournal(journalPath ? journalPath : kDefaultJournalPath);
+    
     
     // Set up a signal handler so we can clean up when we're interrupted from the command line
     // Otherwise we stay in our run loop forever.
@@ -722,36 +4326,23 @@ int main(int argc, const char * argv[])
     
     
     if(bDaemon) {
-        kern_return_t            kr;
-        CFMutableDictionaryRef     matchingDictionary = 0;    // requires <IOKit/IOKitLib.h>
         CFRunLoopSourceRef        runLoopSource;
         static io_connect_t        rootPort;
         IONotificationPortRef    notificationPort;
         io_object_t                notifier;
-        int                        nRet;
+        dispatch_source_t        hangupSource;
         
         // Start run loop:
         // if a device is found, send activation commands
         // if a wake-from-sleep is detected, resend activation commands to all devices
         // if a device disconnects, remove its reference
-        nRet = makeDictionary( &matchingDictionary, kVendorID, kProductID );
-        if (nRet)
-            return nRet;
-
+        // if the configuration changes, apply the plans that changed
         gNotifyPort = IONotificationPortCreate(kIOMasterPortDefault);
         runLoopSource = IONotificationPortGetRunLoopSource(gNotifyPort);
         
         gRunLoop = CFRunLoopGetCurrent();
         CFRunLoopAddSource(gRunLoop, runLoopSource, kCFRunLoopDefaultMode);
-        
-        // Now set up a notification to be called when a device is first matched by I/O Kit.
-        kr = IOServiceAddMatchingNotification(gNotifyPort,                    // notifyPort
-                                              kIOFirstMatchNotification,    // notificationType
-                                              matchingDictionary,            // matching
-                                              DeviceAdded,                    // callback
-                                              NULL,                            // refCon
-                                              &gAddedIter                    // notification
-                                              );
+        gDeferActivations = 1;    // devices are waited for on the main queue, not on the run loop
         
         // Set up callback for when system wakes from sleep
         rootPort = IORegisterForSystemPower(&rootPort, &notificationPort, powerCallback, &notifier);
@@ -761,8 +4352,24 @@ int main(int argc, const char * argv[])
         }
         CFRunLoopAddSource(gRunLoop, IONotificationPortGetRunLoopSource(notificationPort), kCFRunLoopDefaultMode);
         
-        // Iterate once to get already-present devices and arm the notification
-        DeviceAdded(NULL, gAddedIter);
+        // Now set up a notification to be called when a device is first matched by I/O Kit,
+        // one per configured device type.
+        for( int i=0; i<gPlans->nPlans; i++ )
+            armMatching(i);
+        WatchHandoffFile(1);
+        
+        // SIGHUP is handled on the run loop instead of in signal context
+        signal(SIGHUP, SIG_IGN);
+        hangupSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, SIGHUP, 0, dispatch_get_main_queue());
+        dispatch_source_set_event_handler_f(hangupSource, hangupReceived);
+        dispatch_resume(hangupSource);
+        if( gConfigPath )
+            WatchConfigFile();
+        
+        // Level monitoring only starts after the first activation, the inputs are of
+        // little use before that anyway.
+        if( bMonitor && StartLevelMonitor() )
+            fprintf(stderr, "Could not start capture level monitor\n");
         
         // Start the run loop. Now we'll receive notifications.
         if(gVerbose)
@@ -773,6 +4380,12 @@ int main(int argc, const char * argv[])
         fprintf(stderr, "Unexpectedly back from CFRunLoopRun()!\n");
         return -1;
     }
+    else if( deadline > 0 ) {
+        // Check for CM6206 once, without ever taking longer than the deadline. A SIGHUP would
+        // run ActivateDevices in signal context, with no regard for the deadline.
+        signal(SIGHUP, SIG_IGN);
+        return RunOneShot(deadline);
+    }
     else {
         // Check for CM6206 once
         return ActivateDevices();